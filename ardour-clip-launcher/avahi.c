@@ -4,6 +4,7 @@
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sys/time.h>
 
 #include <avahi-client/client.h>
 #include <avahi-client/publish.h>
@@ -13,6 +14,7 @@
 #include <avahi-common/simple-watch.h>
 #include <avahi-common/malloc.h>
 #include <avahi-common/error.h>
+#include <avahi-common/strlst.h>
 #include <avahi-common/timeval.h>
 
 #include <lua.h>
@@ -26,17 +28,43 @@
 
 /* Service publishing. *****************************************************/
 
+// A published entry consists of one or more service records, which are
+// registered together in a single entry group, so that they are committed
+// (and renamed in case of a collision) as a unit.
+
+typedef struct {
+  char *name, *type;
+  uint16_t port;
+  AvahiStringList *txt;
+} record_t;
+
 typedef struct {
   AvahiEntryGroup *group;
   AvahiClient *client;
   AvahiSimplePoll *simple_poll;
-  char *name, *type;
-  uint16_t port;
-  int ret;
+  int nrecords;
+  record_t *records;
+  int ret, list;
 } avahi_service_t;
 
 static void create_services(AvahiClient *c, avahi_service_t *t);
 
+static void rename_services(avahi_service_t *t)
+{
+  // A service name collision with a local service happened. Pick new names.
+  int i;
+  for (i = 0; i < t->nrecords; i++) {
+    char *name = avahi_alternative_service_name(t->records[i].name);
+    assert(name);
+    avahi_free(t->records[i].name);
+    t->records[i].name = name;
+#if DEBUG
+    fprintf(stderr, "service name collision, renaming service to '%s'\n",
+	    name);
+#endif
+  }
+}
+
 static void entry_group_callback(AvahiEntryGroup *g,
 				 AvahiEntryGroupState state,
 				 void *data)
@@ -49,24 +77,16 @@ static void entry_group_callback(AvahiEntryGroup *g,
   case AVAHI_ENTRY_GROUP_ESTABLISHED :
     // The entry group has been established successfully.
 #if DEBUG
-    fprintf(stderr, "service '%s' successfully established.\n", t->name);
+    fprintf(stderr, "service '%s' successfully established.\n",
+	    t->records[0].name);
 #endif
     t->ret = 1;
     break;
-  case AVAHI_ENTRY_GROUP_COLLISION : {
-    char *name;
-    // A service name collision with a local service happened. Pick a new name.
-    name = avahi_alternative_service_name(t->name);
-    avahi_free(t->name);
-    t->name = name;
-    assert(name);
-#if DEBUG
-    fprintf(stderr, "service name collision, renaming service to '%s'\n", name);
-#endif
-    // And recreate the service.
+  case AVAHI_ENTRY_GROUP_COLLISION :
+    rename_services(t);
+    // And recreate the services.
     create_services(avahi_entry_group_get_client(g), t);
     break;
-  }
   case AVAHI_ENTRY_GROUP_FAILURE :
     // Some kind of failure happened while we were registering our services.
     t->ret = avahi_client_errno(avahi_entry_group_get_client(g));
@@ -83,8 +103,7 @@ static void entry_group_callback(AvahiEntryGroup *g,
 
 static void create_services(AvahiClient *c, avahi_service_t *t)
 {
-  char *name;
-  int ret;
+  int i, ret;
   assert(c);
 
   // If this is the first time we're called, let's create a new entry group if
@@ -98,17 +117,20 @@ static void create_services(AvahiClient *c, avahi_service_t *t)
   // was reset previously), add our entries.
 
   if (avahi_entry_group_is_empty(t->group)) {
-    if ((ret = avahi_entry_group_add_service
-	 (t->group, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, 0,
-	  t->name, t->type, NULL, NULL, t->port, NULL)) < 0) {
-      if (ret == AVAHI_ERR_COLLISION) goto collision;
-      t->ret = ret;
+    for (i = 0; i < t->nrecords; i++) {
+      record_t *r = &t->records[i];
+      if ((ret = avahi_entry_group_add_service_strlst
+	   (t->group, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, 0,
+	    r->name, r->type, NULL, NULL, r->port, r->txt)) < 0) {
+	if (ret == AVAHI_ERR_COLLISION) goto collision;
+	t->ret = ret;
 #if DEBUG
-      fprintf(stderr, "failed to add service: %s\n", avahi_strerror(ret));
+	fprintf(stderr, "failed to add service: %s\n", avahi_strerror(ret));
 #endif
-      goto fail;
+	goto fail;
+      }
     }
-    // Tell the server to register the service.
+    // Tell the server to register all the services at once.
     if ((ret = avahi_entry_group_commit(t->group)) < 0) {
       t->ret = ret;
 #if DEBUG
@@ -123,14 +145,7 @@ static void create_services(AvahiClient *c, avahi_service_t *t)
 
  collision:
 
-  // A service name collision with a local service happened. Pick a new name.
-  name = avahi_alternative_service_name(t->name);
-  avahi_free(t->name);
-  t->name = name;
-  assert(name);
-#if DEBUG
-  fprintf(stderr, "service name collision, renaming service to '%s'\n", name);
-#endif
+  rename_services(t);
   avahi_entry_group_reset(t->group);
   create_services(c, t);
   return;
@@ -168,7 +183,19 @@ static void client_callback(AvahiClient *c, AvahiClientState state, void *data)
   }
 }
 
-avahi_service_t *avahi_publish(const char *name, const char *type, int port)
+static void free_records(record_t *records, int n)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    if (records[i].name) avahi_free(records[i].name);
+    if (records[i].type) avahi_free(records[i].type);
+    avahi_string_list_free(records[i].txt);
+  }
+  free(records);
+}
+
+// Publish the given service records (the entry takes ownership of them).
+avahi_service_t *avahi_publish(record_t *records, int n)
 {
   avahi_service_t *t = malloc(sizeof(avahi_service_t));
   int err = 0;
@@ -176,11 +203,9 @@ avahi_service_t *avahi_publish(const char *name, const char *type, int port)
   t->group = NULL;
   t->client = NULL;
   t->simple_poll = NULL;
-  t->name = avahi_strdup(name);
-  t->type = avahi_strdup(type);
-  t->port = port;
-  t->ret = 0;
-  assert(t->name && t->type);
+  t->nrecords = n;
+  t->records = records;
+  t->ret = t->list = 0;
   // Create the main loop.
   if (!(t->simple_poll = avahi_simple_poll_new())) goto fail;
   // Create the client.
@@ -197,6 +222,7 @@ avahi_service_t *avahi_publish(const char *name, const char *type, int port)
 #endif
   if (t->client) avahi_client_free(t->client);
   if (t->simple_poll) avahi_simple_poll_free(t->simple_poll);
+  free_records(records, n);
   free(t);
   return NULL;
 }
@@ -208,8 +234,7 @@ void avahi_unpublish(avahi_service_t *t)
   // FIXME: Is this handled automatically?
   //if (t->client) avahi_client_free(t->client);
   if (t->simple_poll) avahi_simple_poll_free(t->simple_poll);
-  if (t->name) avahi_free(t->name);
-  if (t->type) avahi_free(t->type);
+  free_records(t->records, t->nrecords);
   free(t);
 }
 
@@ -274,17 +299,130 @@ static void free_services(service_t *s)
   }
 }
 
-typedef struct {
+static service_t *copy_services(const service_t *s)
+{
+  // Copy a service list, preserving the order of the entries.
+  service_t *u = NULL, **last = &u;
+  for (; s; s = s->next) {
+    *last = add_service(NULL, s->name, s->type, s->domain, s->addr, s->port);
+    last = &(*last)->next;
+  }
+  return u;
+}
+
+// Discovery updates are collected in a pending service list which is only
+// touched by the browser thread, and get published to Lua as a whole (a new
+// generation of the service list) once things have settled down, i.e., when
+// the browser reports ALL_FOR_NOW or CACHE_EXHAUSTED and no resolves are
+// outstanding, or when nothing has changed for the quiet window. To keep an
+// endless announce storm from holding back the list forever, a batch is
+// never held for more than MAX_HOLD msec, and resolves which haven't
+// produced a result after RESOLVE_TIMEOUT msec are abandoned.
+
+#ifndef QUIET_WINDOW
+#define QUIET_WINDOW 250 // default quiet window (msec)
+#endif
+#ifndef MAX_HOLD
+#define MAX_HOLD 2000
+#endif
+#ifndef RESOLVE_TIMEOUT
+#define RESOLVE_TIMEOUT 5000
+#endif
+
+typedef struct _resolver_t {
+  AvahiServiceResolver *r;
+  AvahiTimeout *timeout;
+  struct _avahi_browser_t *t;
+  struct _resolver_t *next;
+} resolver_t;
+
+typedef struct _avahi_browser_t {
   AvahiServiceBrowser *sb;
   AvahiClient *client;
   AvahiSimplePoll *simple_poll;
   char *type;
   int ret, avail, count;
+  // published service list and its generation (protected by the mutex)
   service_t *services;
+  unsigned gen;
+  // pending updates (browser thread only)
+  service_t *pending;
+  int dirty, settled, quiet;
+  struct timeval first;
+  AvahiTimeout *timeout;
+  resolver_t *resolvers;
   pthread_t thread;
   pthread_mutex_t mutex;
 } avahi_browser_t;
 
+static void publish_services(avahi_browser_t *t)
+{
+  // Publish the pending service list as a new generation.
+  service_t *s = copy_services(t->pending);
+  pthread_mutex_lock(&t->mutex);
+  free_services(t->services);
+  t->services = s;
+  t->gen++;
+  t->avail = 1;
+  pthread_mutex_unlock(&t->mutex);
+  t->dirty = 0;
+  avahi_simple_poll_get(t->simple_poll)->timeout_update(t->timeout, NULL);
+#if DEBUG
+  fprintf(stderr, "(browser) generation %u\n", t->gen);
+#endif
+}
+
+static void quiet_callback(AVAHI_GCC_UNUSED AvahiTimeout *timeout, void *data)
+{
+  // The quiet window (or the maximum hold time) has expired.
+  avahi_browser_t *t = (avahi_browser_t*)data;
+  if (t->dirty) publish_services(t);
+}
+
+static void changed(avahi_browser_t *t)
+{
+  // Record a change in the pending list and (re)arm the quiet timer.
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  if (!t->dirty) {
+    t->first = tv;
+    t->dirty = 1;
+  }
+  avahi_timeval_add(&tv, (AvahiUsec)t->quiet*1000);
+  if (avahi_timeval_diff(&tv, &t->first) > (AvahiUsec)MAX_HOLD*1000) {
+    tv = t->first;
+    avahi_timeval_add(&tv, (AvahiUsec)MAX_HOLD*1000);
+  }
+  avahi_simple_poll_get(t->simple_poll)->timeout_update(t->timeout, &tv);
+}
+
+static void resolver_done(avahi_browser_t *t, resolver_t *u)
+{
+  // Get rid of a finished (or stuck) resolver.
+  resolver_t **p;
+  for (p = &t->resolvers; *p && *p != u; p = &(*p)->next) ;
+  assert(*p);
+  *p = u->next;
+  avahi_simple_poll_get(t->simple_poll)->timeout_free(u->timeout);
+  avahi_service_resolver_free(u->r);
+  free(u);
+  // Publish a settled batch as soon as the last resolve is through. Like in
+  // browse_callback, the initial list gets published even if it didn't
+  // change (e.g., because all resolves failed), so that it's available.
+  if (--t->count == 0 && t->settled && (t->dirty || t->gen == 0))
+    publish_services(t);
+}
+
+static void resolve_timeout(AVAHI_GCC_UNUSED AvahiTimeout *timeout,
+			    void *data)
+{
+  resolver_t *u = (resolver_t*)data;
+#if DEBUG
+  fprintf(stderr, "(resolver) timed out\n");
+#endif
+  resolver_done(u->t, u);
+}
+
 static void resolve_callback(AvahiServiceResolver *r,
 			     AVAHI_GCC_UNUSED AvahiIfIndex interface,
 			     AVAHI_GCC_UNUSED AvahiProtocol protocol,
@@ -301,11 +439,11 @@ static void resolve_callback(AvahiServiceResolver *r,
 {
   // This is called whenever a service has been resolved successfully or timed
   // out.
-  avahi_browser_t *t = (avahi_browser_t*)data;
-  assert(r);
+  resolver_t *u = (resolver_t*)data;
+  avahi_browser_t *t = u->t;
+  assert(r && r == u->r);
   switch (event) {
   case AVAHI_RESOLVER_FAILURE:
-    t->count--;
 #if DEBUG
     fprintf(stderr,
 "(resolver) failed to resolve service '%s' of type '%s' in domain '%s': %s\n",
@@ -317,10 +455,8 @@ static void resolve_callback(AvahiServiceResolver *r,
   case AVAHI_RESOLVER_FOUND: {
     char a[AVAHI_ADDRESS_STR_MAX];
     avahi_address_snprint(a, sizeof(a), address);
-    pthread_mutex_lock(&t->mutex);
-    if (--t->count==0) t->avail = 1;
-    t->services = add_service(t->services, name, type, domain, a, port);
-    pthread_mutex_unlock(&t->mutex);
+    t->pending = add_service(t->pending, name, type, domain, a, port);
+    changed(t);
 #if DEBUG
     fprintf(stderr,
 	    "(resolver) service '%s' of type '%s' in domain '%s': %s:%u\n",
@@ -328,7 +464,7 @@ static void resolve_callback(AvahiServiceResolver *r,
 #endif
   }
   }
-  avahi_service_resolver_free(r);
+  resolver_done(t, u);
 }
 
 static void browse_callback(AvahiServiceBrowser *b,
@@ -347,32 +483,47 @@ static void browse_callback(AvahiServiceBrowser *b,
   assert(b);
   switch (event) {
   case AVAHI_BROWSER_FAILURE:
+    pthread_mutex_lock(&t->mutex);
     t->ret = avahi_client_errno(avahi_service_browser_get_client(b));
+    pthread_mutex_unlock(&t->mutex);
 #if DEBUG
     fprintf(stderr, "(browser) %s\n", avahi_strerror(t->ret));
 #endif
     avahi_simple_poll_quit(t->simple_poll);
     break;
-  case AVAHI_BROWSER_NEW:
-    t->count++;
+  case AVAHI_BROWSER_NEW: {
+    resolver_t *u = malloc(sizeof(resolver_t));
+    struct timeval tv;
+    assert(u);
 #if DEBUG
     fprintf(stderr, "(browser) ADD service '%s' of type '%s' in domain '%s'\n",
 	   name, type, domain);
 #endif
-    if (!(avahi_service_resolver_new
+    // Another burst is under way, hold back the list until it has settled.
+    t->settled = 0;
+    u->t = t;
+    if (!(u->r = avahi_service_resolver_new
 	  (c, interface, protocol, name, type, domain,
-	   AVAHI_PROTO_UNSPEC, 0, resolve_callback, t))) {
+	   AVAHI_PROTO_UNSPEC, 0, resolve_callback, u))) {
 #if DEBUG
       fprintf(stderr, "(resolver) failed to resolve service '%s': %s\n", name,
 	      avahi_strerror(avahi_client_errno(c)));
 #endif
+      free(u);
+      break;
     }
+    u->timeout = avahi_simple_poll_get(t->simple_poll)->timeout_new
+      (avahi_simple_poll_get(t->simple_poll),
+       avahi_elapse_time(&tv, RESOLVE_TIMEOUT, 0), resolve_timeout, u);
+    assert(u->timeout);
+    u->next = t->resolvers;
+    t->resolvers = u;
+    t->count++;
     break;
+  }
   case AVAHI_BROWSER_REMOVE:
-    pthread_mutex_lock(&t->mutex);
-    t->avail = 1;
-    t->services = del_service(t->services, name, type, domain);
-    pthread_mutex_unlock(&t->mutex);
+    t->pending = del_service(t->pending, name, type, domain);
+    changed(t);
 #if DEBUG
     fprintf(stderr, "(browser) DEL service '%s' of type '%s' in domain '%s'\n",
 	   name, type, domain);
@@ -385,6 +536,12 @@ static void browse_callback(AvahiServiceBrowser *b,
 	    event == AVAHI_BROWSER_CACHE_EXHAUSTED ? "cache exhausted" :
 	    "all for now");
 #endif
+    // The burst is over. Publish now if all resolves are through, otherwise
+    // the last one to finish will do it. Also make sure that the initial
+    // (possibly empty) list gets published at least once.
+    t->settled = 1;
+    if (t->count == 0 && (t->dirty || t->gen == 0))
+      publish_services(t);
     break;
   }
 }
@@ -396,7 +553,9 @@ static void browser_client_callback(AvahiClient *c, AvahiClientState state,
   // This is called whenever the client or server state changes.
   assert(c);
   if (state == AVAHI_CLIENT_FAILURE) {
+    pthread_mutex_lock(&t->mutex);
     t->ret = avahi_client_errno(c);
+    pthread_mutex_unlock(&t->mutex);
 #if DEBUG
     fprintf(stderr, "server connection failure: %s\n", avahi_strerror(t->ret));
 #endif
@@ -411,9 +570,10 @@ static void *browser_loop(void *data)
   return NULL;
 }
 
-static avahi_browser_t *avahi_browse(const char *type)
+static avahi_browser_t *avahi_browse(const char *type, int quiet)
 {
   avahi_browser_t *t = malloc(sizeof(avahi_browser_t));
+  const AvahiPoll *api = NULL;
   int err = 0;
   assert(t);
   t->sb = NULL;
@@ -421,13 +581,22 @@ static avahi_browser_t *avahi_browse(const char *type)
   t->simple_poll = NULL;
   t->type = avahi_strdup(type);
   t->ret = t->avail = t->count = 0;
-  t->services = NULL;
+  t->services = t->pending = NULL;
+  t->gen = 0;
+  t->dirty = t->settled = 0;
+  t->quiet = quiet;
+  t->timeout = NULL;
+  t->resolvers = NULL;
   assert(t->type);
+  pthread_mutex_init(&t->mutex, NULL);
   // Create the main loop.
   if (!(t->simple_poll = avahi_simple_poll_new())) goto fail;
+  // Create the timer for the quiet window (initially disarmed).
+  api = avahi_simple_poll_get(t->simple_poll);
+  if (!(t->timeout = api->timeout_new(api, NULL, quiet_callback, t)))
+    goto fail;
   // Create the client.
-  t->client = avahi_client_new(avahi_simple_poll_get(t->simple_poll), 0,
-			       browser_client_callback, t, &err);
+  t->client = avahi_client_new(api, 0, browser_client_callback, t, &err);
   if (!t->client) goto fail;
   // Create the service browser.
   t->sb = avahi_service_browser_new
@@ -435,7 +604,6 @@ static avahi_browser_t *avahi_browse(const char *type)
      NULL, 0, browse_callback, t);
   if (!t->sb) goto fail;
   if (pthread_create(&t->thread, NULL, browser_loop, t)) goto fail;
-  pthread_mutex_init(&t->mutex, NULL);
   return t;
  fail:
 #if DEBUG
@@ -447,21 +615,35 @@ static avahi_browser_t *avahi_browse(const char *type)
 #endif
   if (t->sb) avahi_service_browser_free(t->sb);
   if (t->client) avahi_client_free(t->client);
+  if (t->timeout) api->timeout_free(t->timeout);
   if (t->simple_poll) avahi_simple_poll_free(t->simple_poll);
+  pthread_mutex_destroy(&t->mutex);
+  avahi_free(t->type);
   free(t);
   return NULL;
 }
 
 static void avahi_close(avahi_browser_t *t)
 {
+  const AvahiPoll *api;
   if (!t) return;
   avahi_simple_poll_quit(t->simple_poll);
   pthread_join(t->thread, NULL);
+  api = avahi_simple_poll_get(t->simple_poll);
+  while (t->resolvers) {
+    resolver_t *u = t->resolvers;
+    t->resolvers = u->next;
+    api->timeout_free(u->timeout);
+    avahi_service_resolver_free(u->r);
+    free(u);
+  }
+  if (t->timeout) api->timeout_free(t->timeout);
   if (t->sb) avahi_service_browser_free(t->sb);
   if (t->client) avahi_client_free(t->client);
   if (t->simple_poll) avahi_simple_poll_free(t->simple_poll);
   if (t->type) avahi_free(t->type);
   free_services(t->services);
+  free_services(t->pending);
   pthread_mutex_destroy(&t->mutex);
   free(t);
 }
@@ -481,12 +663,102 @@ static int avahi_avail(avahi_browser_t *t)
 
 /* Lua API. ****************************************************************/
 
+// Get the TXT data at the given stack index, a list of "key=value" strings
+// or a table mapping keys to values. Returns -1 if the data is invalid.
+static int get_txt(lua_State *L, int idx, AvahiStringList **txt)
+{
+  *txt = NULL;
+  if (lua_isnoneornil(L, idx)) return 0;
+  if (!lua_istable(L, idx)) return -1;
+  idx = lua_absindex(L, idx);
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1)) {
+      *txt = avahi_string_list_add_pair(*txt, lua_tostring(L, -2),
+					lua_tostring(L, -1));
+    } else if (lua_type(L, -2) == LUA_TNUMBER &&
+	       lua_type(L, -1) == LUA_TSTRING) {
+      *txt = avahi_string_list_add(*txt, lua_tostring(L, -1));
+    } else {
+      lua_pop(L, 2);
+      return -1;
+    }
+    lua_pop(L, 1);
+  }
+  // avahi_string_list_add prepends, restore the original order
+  *txt = avahi_string_list_reverse(*txt);
+  return 0;
+}
+
+// Get the service record at the given stack index. Returns an error message
+// if the record is invalid, NULL otherwise. A missing name defaults to the
+// name of the previous record (if any).
+static const char *get_record(lua_State *L, int idx, record_t *r,
+			      const record_t *prev)
+{
+  lua_Integer port;
+  int isnum, res;
+  if (!lua_istable(L, idx)) return "service record must be a table";
+  idx = lua_absindex(L, idx);
+  lua_getfield(L, idx, "name");
+  r->name = avahi_strdup(lua_isstring(L, -1) ? lua_tostring(L, -1) :
+			 prev ? prev->name : NULL);
+  lua_getfield(L, idx, "type");
+  r->type = avahi_strdup(lua_isstring(L, -1) ? lua_tostring(L, -1) : NULL);
+  lua_getfield(L, idx, "port");
+  port = lua_tointegerx(L, -1, &isnum);
+  lua_getfield(L, idx, "txt");
+  res = get_txt(L, -1, &r->txt);
+  lua_pop(L, 4);
+  if (!r->name) return "missing service name";
+  if (!r->type) return "missing service type";
+  if (!isnum || port < 0 || port > 65535) return "invalid port number";
+  if (res < 0) return "invalid TXT data";
+  r->port = port;
+  return NULL;
+}
+
+// publish(name, type, port [, txt]): publish a service with the given name,
+// type, port and (optional) TXT data. publish(records): publish several
+// services at once, given as a list of tables with the fields name, type,
+// port and txt; the records are registered in a single entry group, so that
+// they're committed in one go, and renamed together in case of a collision.
 static int l_avahi_publish(lua_State *L)
 {
-  const char *name = luaL_checkstring(L, 1);
-  const char *type = luaL_checkstring(L, 2);
-  int port = luaL_checkinteger(L, 3);
-  avahi_service_t *t = avahi_publish(name, type, port);
+  record_t *records;
+  const char *err = NULL;
+  int i, n = 1, list = lua_istable(L, 1);
+  avahi_service_t *t;
+  if (list && (n = lua_rawlen(L, 1)) < 1)
+    return luaL_error(L, "mdns: no service records");
+  if (!list) {
+    // check the arguments before we allocate anything
+    luaL_checkstring(L, 1);
+    luaL_checkstring(L, 2);
+    luaL_checkinteger(L, 3);
+  }
+  records = calloc(n, sizeof(record_t));
+  assert(records);
+  if (list) {
+    for (i = 0; i < n && !err; i++) {
+      lua_rawgeti(L, 1, i+1);
+      err = get_record(L, -1, &records[i], i > 0 ? &records[i-1] : NULL);
+      lua_pop(L, 1);
+    }
+  } else {
+    records->name = avahi_strdup(lua_tostring(L, 1));
+    records->type = avahi_strdup(lua_tostring(L, 2));
+    records->port = lua_tointeger(L, 3);
+    if (get_txt(L, 4, &records->txt) < 0) err = "invalid TXT data";
+  }
+  if (err) {
+    // the records have been allocated at this point, but nothing has been
+    // registered yet, so we just need to free them again
+    free_records(records, n);
+    return luaL_error(L, "mdns: %s", err);
+  }
+  t = avahi_publish(records, n);
+  if (t) t->list = list;
   lua_pushlightuserdata(L, t);
   return 1;
 }
@@ -516,16 +788,23 @@ static int l_avahi_check(lua_State *L)
   if (t->ret < 0) {
     lua_pushinteger(L, t->ret);
   } else {
-    lua_createtable(L, 3, 0);
-    lua_pushstring(L, "name");
-    lua_pushstring(L, t->name);
-    lua_settable(L, -3);
-    lua_pushstring(L, "type");
-    lua_pushstring(L, t->type);
-    lua_settable(L, -3);
-    lua_pushstring(L, "port");
-    lua_pushinteger(L, t->port);
-    lua_settable(L, -3);
+    // the published record, or a list of them if a list was published
+    int i;
+    if (t->list) lua_createtable(L, t->nrecords, 0);
+    for (i = 0; i < t->nrecords; i++) {
+      lua_createtable(L, 3, 0);
+      lua_pushstring(L, "name");
+      lua_pushstring(L, t->records[i].name);
+      lua_settable(L, -3);
+      lua_pushstring(L, "type");
+      lua_pushstring(L, t->records[i].type);
+      lua_settable(L, -3);
+      lua_pushstring(L, "port");
+      lua_pushinteger(L, t->records[i].port);
+      lua_settable(L, -3);
+      if (!t->list) break;
+      lua_rawseti(L, -2, i+1);
+    }
   }
   return 1;
 }
@@ -533,7 +812,9 @@ static int l_avahi_check(lua_State *L)
 static int l_avahi_browse(lua_State *L)
 {
   const char *type = luaL_checkstring(L, 1);
-  avahi_browser_t *t = avahi_browse(type);
+  // optional quiet window in msec, for coalescing bursts of updates
+  int quiet = luaL_optinteger(L, 2, QUIET_WINDOW);
+  avahi_browser_t *t = avahi_browse(type, quiet > 0 ? quiet : 0);
   lua_pushlightuserdata(L, t);
   return 1;
 }
@@ -559,6 +840,7 @@ static int l_avahi_avail(lua_State *L)
 static int l_avahi_get(lua_State *L)
 {
   avahi_browser_t *t = (avahi_browser_t*)lua_touserdata(L, 1);
+  int n = 1;
   pthread_mutex_lock(&t->mutex);
   if (t->ret < 0) {
     lua_pushinteger(L, t->ret);
@@ -587,9 +869,13 @@ static int l_avahi_get(lua_State *L)
       lua_settable(L, -3);
     }
     t->avail = 0;
+    // also return the generation of the list, so that the caller can tell
+    // whether anything happened since it last looked
+    lua_pushinteger(L, t->gen);
+    n = 2;
   }
   pthread_mutex_unlock(&t->mutex);
-  return 1;
+  return n;
 }
 
 static const struct luaL_Reg avahi [] = {
@@ -65,12 +65,25 @@ static void *main_loop(void *data)
 
 /* Service publishing. *****************************************************/
 
+// A published entry consists of one or more service records, which are all
+// registered over a single shared connection to the daemon, so that they're
+// sent in one go and we only have to wait for the replies on one socket.
+
 typedef struct {
   DNSServiceRef service_ref;
-  bool done, gc;
   char *name, *type;
   uint16_t port;
+  TXTRecordRef txt;
+  bool done;
   int ret;
+} record_t;
+
+typedef struct {
+  DNSServiceRef service_ref;
+  bool done, gc;
+  int nrecords;
+  record_t *records;
+  int ret, list;
 } bonjour_service_t;
 
 static void register_callback(DNSServiceRef service,
@@ -81,8 +94,9 @@ static void register_callback(DNSServiceRef service,
 			      const char *domain,
 			      void *data)
 {
-  bonjour_service_t *t = (bonjour_service_t*)data;
+  record_t *t = (record_t*)data;
   t->ret = ret;
+  t->done = true;
   if (ret != kDNSServiceErr_NoError) {
 #if DEBUG
     fprintf(stderr, "failed to register service '%s', return code: %d\n", t->name, ret);
@@ -109,24 +123,48 @@ static void register_callback(DNSServiceRef service,
   }
 }
 
-static bonjour_service_t *bonjour_publish(const char *name, const char *type, int port)
+static void free_records(record_t *records, int n)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    if (records[i].name) free(records[i].name);
+    if (records[i].type) free(records[i].type);
+    TXTRecordDeallocate(&records[i].txt);
+  }
+  free(records);
+}
+
+// Publish the given service records (the entry takes ownership of them).
+static bonjour_service_t *bonjour_publish(record_t *records, int n)
 {
   bonjour_service_t *t = calloc(1, sizeof(bonjour_service_t));
+  int i;
   assert(t);
   t->done = false;
-  t->name = strdup(name);
-  t->type = strdup(type);
-  t->port = port;
-  t->ret = 0;
-  assert(t->name && t->type);
-  // Create the service record.
-  DNSServiceErrorType err =
-    DNSServiceRegister(&t->service_ref, 0, 0, t->name, t->type, NULL, NULL, htons(port), 0, NULL,
-		       register_callback, t);
+  t->nrecords = n;
+  t->records = records;
+  t->ret = t->list = 0;
+  // Create the shared connection.
+  DNSServiceErrorType err = DNSServiceCreateConnection(&t->service_ref);
   if (err != kDNSServiceErr_NoError) goto fail;
+  // Create the service records.
+  for (i = 0; i < n; i++) {
+    record_t *r = &records[i];
+    r->service_ref = t->service_ref;
+    err = DNSServiceRegister(&r->service_ref, kDNSServiceFlagsShareConnection,
+			     0, r->name, r->type, NULL, NULL, htons(r->port),
+			     TXTRecordGetLength(&r->txt),
+			     TXTRecordGetBytesPtr(&r->txt),
+			     register_callback, r);
+    if (err != kDNSServiceErr_NoError) {
+      // this also deallocates the records registered so far
+      DNSServiceRefDeallocate(t->service_ref);
+      goto fail;
+    }
+  }
   return t;
  fail:
-  free(t->name); free(t->type); free(t);
+  free_records(records, n); free(t);
 #if DEBUG
   fprintf(stderr, "couldn't create service, return code: %d\n", err);
 #endif
@@ -135,10 +173,12 @@ static bonjour_service_t *bonjour_publish(const char *name, const char *type, in
 
 static void bonjour_unpublish(bonjour_service_t *t)
 {
+  int i;
   if (!t) return;
+  for (i = 0; i < t->nrecords; i++)
+    DNSServiceRefDeallocate(t->records[i].service_ref);
   DNSServiceRefDeallocate(t->service_ref);
-  if (t->name) free(t->name);
-  if (t->type) free(t->type);
+  free_records(t->records, t->nrecords);
   free(t);
 }
 
@@ -206,7 +246,8 @@ typedef struct {
   DNSServiceRef service_ref;
   bool done, gc;
   char *type;
-  int ret, avail;
+  int ret, avail, dirty;
+  unsigned gen;
   service_t *services;
   pthread_t thread;
   pthread_mutex_t mutex;
@@ -250,6 +291,7 @@ static void getaddr_callback(DNSServiceRef service,
     sprintf(ip, "%u.%u.%u.%u", i1, i2, i3, i4);
     pthread_mutex_lock(&t->mutex);
     t->avail = 1;
+    t->gen++;
     t->services = add_service(t->services, name, type, domain, ip, port);
     pthread_mutex_unlock(&t->mutex);
 #if DEBUG
@@ -372,13 +414,20 @@ static void browse_callback(DNSServiceRef service,
       free(r->name); free(r->type); free(r->domain); free(r);
     }
   } else {
-    t->avail = 1;
+    t->dirty = 1;
     t->services = del_service(t->services, name, type, domain);
 #if DEBUG
     fprintf(stderr, "(browser) DEL service '%s' of type '%s' in domain '%s'\n",
 	   name, type, domain);
 #endif
   }
+  // Coalesce bursts of removals, the list is only flagged as changed once
+  // the daemon has no more events queued up for us.
+  if (t->dirty && !(flags & kDNSServiceFlagsMoreComing)) {
+    t->avail = 1;
+    t->gen++;
+    t->dirty = 0;
+  }
   pthread_mutex_unlock(&t->mutex);
 }
 
@@ -388,7 +437,8 @@ static bonjour_browser_t *bonjour_browse(const char *type)
   assert(t);
   t->type = strdup(type);
   t->done = false;
-  t->ret = t->avail = 0;
+  t->ret = t->avail = t->dirty = 0;
+  t->gen = 0;
   t->services = NULL;
   assert(t->type);
   // Create the service browser.
@@ -435,12 +485,116 @@ static int bonjour_avail(bonjour_browser_t *t)
 
 /* Lua API. ****************************************************************/
 
+// Add a key=value pair to the given TXT record. A missing value gives a
+// boolean attribute. Returns -1 if the pair is invalid.
+static int add_txt(TXTRecordRef *txt, const char *key, const char *val)
+{
+  size_t n = val ? strlen(val) : 0;
+  if (n > 255) return -1;
+  return TXTRecordSetValue(txt, key, n, val) == kDNSServiceErr_NoError ? 0 : -1;
+}
+
+// Get the TXT data at the given stack index, a list of "key=value" strings
+// or a table mapping keys to values. Returns -1 if the data is invalid.
+static int get_txt(lua_State *L, int idx, TXTRecordRef *txt)
+{
+  if (lua_isnoneornil(L, idx)) return 0;
+  if (!lua_istable(L, idx)) return -1;
+  idx = lua_absindex(L, idx);
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    int ret = -1;
+    if (lua_type(L, -2) == LUA_TSTRING && lua_isstring(L, -1)) {
+      ret = add_txt(txt, lua_tostring(L, -2), lua_tostring(L, -1));
+    } else if (lua_type(L, -2) == LUA_TNUMBER &&
+	       lua_type(L, -1) == LUA_TSTRING) {
+      // split the string at the first '='
+      const char *s = lua_tostring(L, -1), *eq = strchr(s, '=');
+      char *key = eq ? strndup(s, eq-s) : strdup(s);
+      assert(key);
+      ret = add_txt(txt, key, eq ? eq+1 : NULL);
+      free(key);
+    }
+    lua_pop(L, 1);
+    if (ret < 0) {
+      lua_pop(L, 1);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Get the service record at the given stack index. Returns an error message
+// if the record is invalid, NULL otherwise. A missing name defaults to the
+// name of the previous record (if any).
+static const char *get_record(lua_State *L, int idx, record_t *r,
+			      const record_t *prev)
+{
+  lua_Integer port;
+  int isnum, res;
+  const char *s;
+  if (!lua_istable(L, idx)) return "service record must be a table";
+  idx = lua_absindex(L, idx);
+  lua_getfield(L, idx, "name");
+  s = lua_isstring(L, -1) ? lua_tostring(L, -1) : prev ? prev->name : NULL;
+  r->name = s ? strdup(s) : NULL;
+  lua_getfield(L, idx, "type");
+  r->type = lua_isstring(L, -1) ? strdup(lua_tostring(L, -1)) : NULL;
+  lua_getfield(L, idx, "port");
+  port = lua_tointegerx(L, -1, &isnum);
+  lua_getfield(L, idx, "txt");
+  res = get_txt(L, -1, &r->txt);
+  lua_pop(L, 4);
+  if (!r->name) return "missing service name";
+  if (!r->type) return "missing service type";
+  if (!isnum || port < 0 || port > 65535) return "invalid port number";
+  if (res < 0) return "invalid TXT data";
+  r->port = port;
+  return NULL;
+}
+
+// publish(name, type, port [, txt]): publish a service with the given name,
+// type, port and (optional) TXT data. publish(records): publish several
+// services at once, given as a list of tables with the fields name, type,
+// port and txt; the records are registered over a single connection.
 static int l_bonjour_publish(lua_State *L)
 {
-  const char *name = luaL_checkstring(L, 1);
-  const char *type = luaL_checkstring(L, 2);
-  int port = luaL_checkinteger(L, 3);
-  bonjour_service_t *t = bonjour_publish(name, type, port);
+  record_t *records;
+  const char *err = NULL;
+  int i, n = 1, list = lua_istable(L, 1);
+  bonjour_service_t *t;
+  if (list && (n = lua_rawlen(L, 1)) < 1)
+    return luaL_error(L, "mdns: no service records");
+  if (!list) {
+    // check the arguments before we allocate anything
+    luaL_checkstring(L, 1);
+    luaL_checkstring(L, 2);
+    luaL_checkinteger(L, 3);
+  }
+  records = calloc(n, sizeof(record_t));
+  assert(records);
+  for (i = 0; i < n; i++)
+    TXTRecordCreate(&records[i].txt, 0, NULL);
+  if (list) {
+    for (i = 0; i < n && !err; i++) {
+      lua_rawgeti(L, 1, i+1);
+      err = get_record(L, -1, &records[i], i > 0 ? &records[i-1] : NULL);
+      lua_pop(L, 1);
+    }
+  } else {
+    records->name = strdup(lua_tostring(L, 1));
+    records->type = strdup(lua_tostring(L, 2));
+    records->port = lua_tointeger(L, 3);
+    if (get_txt(L, 4, &records->txt) < 0) err = "invalid TXT data";
+  }
+  if (err) {
+    // the records have been allocated at this point, but nothing has been
+    // registered yet, so we just need to free them again
+    free_records(records, n);
+    return luaL_error(L, "mdns: %s", err);
+  }
+  t = bonjour_publish(records, n);
+  if (t) t->list = list;
   lua_pushlightuserdata(L, t);
   return 1;
 }
@@ -465,23 +619,37 @@ static int l_bonjour_check(lua_State *L)
 {
   bonjour_service_t *t = (bonjour_service_t*)lua_touserdata(L, 1);
   if (!t) return 0;
-  int ret = t->done?t->ret:DNSServiceProcessResult(t->service_ref);
-  t->done = true;
-  if (ret != kDNSServiceErr_NoError) {
-    lua_pushinteger(L, ret);
-  } else if (t->ret < 0) {
+  if (!t->done) {
+    // wait until all records have been registered (or one of them failed)
+    int i = 0;
+    while (i < t->nrecords && !t->ret) {
+      if (t->records[i].done)
+	t->ret = t->records[i++].ret;
+      else
+	t->ret = DNSServiceProcessResult(t->service_ref);
+    }
+    t->done = true;
+  }
+  if (t->ret != kDNSServiceErr_NoError) {
     lua_pushinteger(L, t->ret);
   } else {
-    lua_createtable(L, 3, 0);
-    lua_pushstring(L, "name");
-    lua_pushstring(L, t->name);
-    lua_settable(L, -3);
-    lua_pushstring(L, "type");
-    lua_pushstring(L, t->type);
-    lua_settable(L, -3);
-    lua_pushstring(L, "port");
-    lua_pushinteger(L, t->port);
-    lua_settable(L, -3);
+    // the published record, or a list of them if a list was published
+    int i;
+    if (t->list) lua_createtable(L, t->nrecords, 0);
+    for (i = 0; i < t->nrecords; i++) {
+      lua_createtable(L, 3, 0);
+      lua_pushstring(L, "name");
+      lua_pushstring(L, t->records[i].name);
+      lua_settable(L, -3);
+      lua_pushstring(L, "type");
+      lua_pushstring(L, t->records[i].type);
+      lua_settable(L, -3);
+      lua_pushstring(L, "port");
+      lua_pushinteger(L, t->records[i].port);
+      lua_settable(L, -3);
+      if (!t->list) break;
+      lua_rawseti(L, -2, i+1);
+    }
   }
   return 1;
 }
@@ -489,6 +657,8 @@ static int l_bonjour_check(lua_State *L)
 static int l_bonjour_browse(lua_State *L)
 {
   const char *type = luaL_checkstring(L, 1);
+  // The optional quiet window of the Avahi version isn't needed here, the
+  // Bonjour API tells us directly when more events are coming.
   bonjour_browser_t *t = bonjour_browse(type);
   lua_pushlightuserdata(L, t);
   return 1;
@@ -515,6 +685,7 @@ static int l_bonjour_avail(lua_State *L)
 static int l_bonjour_get(lua_State *L)
 {
   bonjour_browser_t *t = (bonjour_browser_t*)lua_touserdata(L, 1);
+  int n = 1;
   pthread_mutex_lock(&t->mutex);
   if (t->ret < 0) {
     lua_pushinteger(L, t->ret);
@@ -543,9 +714,12 @@ static int l_bonjour_get(lua_State *L)
       lua_settable(L, -3);
     }
     t->avail = 0;
+    // also return the generation of the list
+    lua_pushinteger(L, t->gen);
+    n = 2;
   }
   pthread_mutex_unlock(&t->mutex);
-  return 1;
+  return n;
 }
 
 static const struct luaL_Reg bonjour [] = {
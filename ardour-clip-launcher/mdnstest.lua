@@ -0,0 +1,56 @@
+-- Test for publishing several service records at once with the mdns module.
+-- Run this with `make test` (or `lua mdnstest.lua` after `make`). This needs
+-- a running Avahi daemon (Linux) or Bonjour (Mac, Windows). Two records with
+-- TXT data are published under the same name, and mdns.check must report
+-- both of them; then some invalid records must be rejected.
+
+-- Author: Albert Gräf <aggraef@gmail.com>, Dept. of Music-Informatics,
+-- Johannes Gutenberg University (JGU) of Mainz, Germany, please check
+-- https://agraef.github.io/ for a list of my software.
+
+-- Distributed under the GPLv3+, please check the accompanying COPYING file
+-- for details.
+
+package.cpath = "./?.so;" .. package.cpath
+local mdns = require 'mdns'
+
+local name = "mdnstest " .. os.time()
+
+-- TXT data can be given as a list of "key=value" strings or as a table,
+-- and the second record takes its name from the first one
+local records = {
+   { name = name, type = "_osc._udp", port = 9000,
+     txt = { "txtvers=1", "role=test" } },
+   { type = "_apple-midi._udp", port = 9001,
+     txt = { txtvers = "1" } },
+}
+
+local s = assert(mdns.publish(records))
+local info = mdns.check(s)
+assert(type(info) == "table", "publish failed, error " .. tostring(info))
+assert(#info == 2, "expected 2 records, got " .. #info)
+for i, r in ipairs(info) do
+   assert(r.type == records[i].type and r.port == records[i].port,
+	  string.format("record %d: got %s %s", i, r.type, r.port))
+end
+-- the records are renamed together in case of a collision
+assert(info[1].name == info[2].name,
+       string.format("names differ: %s, %s", info[1].name, info[2].name))
+mdns.unpublish(s)
+
+-- invalid records are rejected with an error
+local function reject(recs, msg)
+   local ok, err = pcall(mdns.publish, recs)
+   assert(not ok and err:find(msg, 1, true),
+	  "expected '" .. msg .. "', got " .. tostring(err))
+end
+
+reject({}, "no service records")
+reject({ { type = "_osc._udp", port = 9000 } }, "missing service name")
+reject({ { name = name, port = 9000 } }, "missing service type")
+reject({ { name = name, type = "_osc._udp", port = 70000 } },
+       "invalid port number")
+reject({ records[1], { type = "_osc._udp", port = 9000, txt = { {} } } },
+       "invalid TXT data")
+
+print("mdnstest: all tests passed")
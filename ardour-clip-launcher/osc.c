@@ -0,0 +1,910 @@
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#define RECEIVER 1
+#endif
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#ifndef DEBUG
+// Set this to a nonzero value to enable debugging output.
+#define DEBUG 0
+#endif
+
+// OSC encoder and decoder for Lua. This implements just the parts of the OSC
+// 1.0 spec that we need to talk to Ardour, i.e., messages with the common
+// argument types, and bundles. Decoding dispatches on the address pattern
+// using a precompiled hash table, so that the addresses we're interested in
+// can be recognized without creating a Lua string for each message.
+
+// On Unix-like systems there's also a threaded receiver, which listens on a
+// UDP port and decodes incoming packets on its own thread, so that bursts of
+// network traffic don't hold up the caller's thread. The decoded messages
+// are handed over through a bounded single-producer/single-consumer ring,
+// which the caller drains at its leisure.
+
+// Max nesting level of bundles that we're prepared to decode.
+#define MAX_DEPTH 8
+
+// Offset between the Unix and the NTP epoch (1900-01-01) in seconds.
+#define NTP_OFFSET 2208988800UL
+
+#define DISPATCHER "osc.dispatcher"
+#define RECEIVER_T "osc.receiver"
+
+// Number of messages in the receiver's ring (a power of 2), and maximum size
+// of a message in the ring (address, type tags and argument data).
+#define RING_SIZE 1024
+#define EVENT_SIZE 512
+
+// Maximum size of a UDP datagram.
+#define DGRAM_MAX 65536
+
+/* Helper functions. *******************************************************/
+
+static size_t pad4(size_t n)
+{
+  return (n+3) & ~(size_t)3;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+  return ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) |
+    ((uint32_t)p[2]<<8) | (uint32_t)p[3];
+}
+
+static void put32(unsigned char *p, uint32_t x)
+{
+  p[0] = x>>24; p[1] = x>>16; p[2] = x>>8; p[3] = x;
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+  return ((uint64_t)get32(p)<<32) | get32(p+4);
+}
+
+// Length of the OSC string at p including padding, 0 if it isn't properly
+// terminated within n bytes.
+static size_t oscstrlen(const unsigned char *p, size_t n)
+{
+  const unsigned char *q = memchr(p, 0, n);
+  size_t len;
+  if (!q) return 0;
+  len = pad4(q-p+1);
+  return len <= n ? len : 0;
+}
+
+// Convert Unix time (in seconds) to an NTP timetag and back. 0 denotes the
+// special "immediately" timetag (which is 1 in NTP format).
+static uint64_t ntp_timetag(double t)
+{
+  double s;
+  if (t <= 0) return 1;
+  s = (double)(uint64_t)t;
+  return ((uint64_t)(s + NTP_OFFSET) << 32) |
+    (uint64_t)((t - s) * 4294967296.0);
+}
+
+static double unix_time(uint64_t tt)
+{
+  if (tt <= 1) return 0;
+  return (double)(tt>>32) - NTP_OFFSET + (double)(tt & 0xffffffff) / 4294967296.0;
+}
+
+/* Address dispatch. *******************************************************/
+
+typedef struct {
+  char *path;		// address, NULL if slot is empty
+  size_t len;
+  int index;		// 1-based index in the address list
+} slot_t;
+
+typedef struct {
+  size_t size;		// number of slots (a power of 2)
+  slot_t *slots;
+} dispatcher_t;
+
+// FNV-1a hash
+static uint32_t hash(const unsigned char *s, size_t n)
+{
+  uint32_t h = 2166136261u;
+  while (n--) {
+    h ^= *s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Look up the address at p (of length n, not necessarily terminated) in the
+// table, returns its index or 0 if not found.
+static int lookup(const dispatcher_t *d, const unsigned char *p, size_t n)
+{
+  size_t mask, i;
+  if (!d || !d->size) return 0;
+  mask = d->size-1;
+  for (i = hash(p, n) & mask; d->slots[i].path; i = (i+1) & mask)
+    if (d->slots[i].len == n && !memcmp(d->slots[i].path, p, n))
+      return d->slots[i].index;
+  return 0;
+}
+
+static void insert(dispatcher_t *d, const char *s, size_t n, int index)
+{
+  size_t mask = d->size-1, i;
+  for (i = hash((const unsigned char*)s, n) & mask; d->slots[i].path;
+       i = (i+1) & mask)
+    if (d->slots[i].len == n && !memcmp(d->slots[i].path, s, n))
+      return; // duplicate, first one wins
+  d->slots[i].path = malloc(n+1);
+  assert(d->slots[i].path);
+  memcpy(d->slots[i].path, s, n+1);
+  d->slots[i].len = n;
+  d->slots[i].index = index;
+}
+
+/* Decoder. ****************************************************************/
+
+// Push the arguments of the message with the given type tags and data onto
+// the Lua stack as a table. Returns 0 if the message is malformed. With L ==
+// NULL, the arguments are just checked, which can be done in any thread.
+static int push_args(lua_State *L, const char *types, const unsigned char *p,
+		     size_t n)
+{
+  int k = 0;
+  if (L) lua_createtable(L, strlen(types), 0);
+  for (; *types; types++) {
+    size_t len;
+    switch (*types) {
+    case 'i': case 'c': case 'r': case 'm':
+      if (n < 4) return 0;
+      if (L) lua_pushinteger(L, (int32_t)get32(p));
+      p += 4; n -= 4;
+      break;
+    case 'f': {
+      union { uint32_t i; float f; } u;
+      if (n < 4) return 0;
+      u.i = get32(p);
+      if (L) lua_pushnumber(L, u.f);
+      p += 4; n -= 4;
+      break;
+    }
+    case 'h':
+      if (n < 8) return 0;
+      if (L) lua_pushinteger(L, (int64_t)get64(p));
+      p += 8; n -= 8;
+      break;
+    case 'd': {
+      union { uint64_t i; double d; } u;
+      if (n < 8) return 0;
+      u.i = get64(p);
+      if (L) lua_pushnumber(L, u.d);
+      p += 8; n -= 8;
+      break;
+    }
+    case 't':
+      if (n < 8) return 0;
+      if (L) lua_pushnumber(L, unix_time(get64(p)));
+      p += 8; n -= 8;
+      break;
+    case 's': case 'S':
+      if (!(len = oscstrlen(p, n))) return 0;
+      if (L) lua_pushstring(L, (const char*)p);
+      p += len; n -= len;
+      break;
+    case 'b':
+      if (n < 4) return 0;
+      len = get32(p);
+      if (pad4(len) > n-4) return 0;
+      if (L) lua_pushlstring(L, (const char*)p+4, len);
+      p += 4+pad4(len); n -= 4+pad4(len);
+      break;
+    case 'T':
+      if (L) lua_pushinteger(L, 1);
+      break;
+    case 'F':
+      if (L) lua_pushinteger(L, 0);
+      break;
+    default:
+      // nil, impulse, array brackets and unknown tags carry no data
+      continue;
+    }
+    if (L) lua_rawseti(L, -2, ++k);
+  }
+  return 1;
+}
+
+// A message found by parse_packet. The address and type tags point into the
+// packet, types without the leading comma.
+typedef struct {
+  int index;			// address index in the dispatcher, 0 if none
+  const char *path, *types;
+  size_t pathlen;
+  const unsigned char *data;	// argument data
+  size_t size;
+  double time;			// Unix time of the enclosing bundle
+} msg_t;
+
+// Callback invoked for each message; returns 0 to abort parsing.
+typedef int (*emit_t)(void *arg, const msg_t *m);
+
+// Parse the packet at p of size n, passing each message to the given
+// callback. t is the Unix time of the enclosing bundle (0 = immediately).
+// Returns 0 if the packet is malformed. This doesn't touch the Lua state, so
+// that it can also be done in the receiver thread (see below).
+static int parse_packet(const dispatcher_t *d, const unsigned char *p,
+			size_t n, double t, int depth, emit_t emit, void *arg)
+{
+  size_t len;
+  if (n < 4 || (n & 3)) return 0;
+  if (n >= 16 && !memcmp(p, "#bundle", 8)) {
+    if (depth >= MAX_DEPTH) return 0;
+    t = unix_time(get64(p+8));
+    p += 16; n -= 16;
+    while (n >= 4) {
+      size_t size = get32(p);
+      if (size > n-4 ||
+	  !parse_packet(d, p+4, size, t, depth+1, emit, arg))
+	return 0;
+      p += 4+size; n -= 4+size;
+    }
+    return n == 0;
+  } else if (*p == '/') {
+    msg_t m;
+    if (!(len = oscstrlen(p, n))) return 0;
+    m.path = (const char*)p;
+    m.pathlen = strlen(m.path);
+    m.types = "";
+    p += len; n -= len;
+    if (n > 0 && *p == ',') {
+      if (!(len = oscstrlen(p, n))) return 0;
+      m.types = (const char*)p+1;
+      p += len; n -= len;
+    }
+    if (!push_args(NULL, m.types, p, n)) return 0;
+    m.index = lookup(d, (const unsigned char*)m.path, m.pathlen);
+    m.data = p; m.size = n;
+    m.time = t;
+    return emit(arg, &m);
+  } else
+    return 0;
+}
+
+// The table of decoded messages on top of the Lua stack, and the number of
+// messages in it.
+typedef struct {
+  lua_State *L;
+  int k;
+} result_t;
+
+// Add a message to the result table. Each message is stored as a table
+// {key, atoms, time}, where key is the address index in the dispatcher or
+// the address itself if it isn't in the table, and time is the Unix time of
+// the enclosing bundle (0 = immediately).
+static int push_msg(void *arg, const msg_t *m)
+{
+  result_t *r = (result_t*)arg;
+  lua_State *L = r->L;
+  lua_createtable(L, 3, 0);
+  if (m->index)
+    lua_pushinteger(L, m->index);
+  else
+    lua_pushlstring(L, m->path, m->pathlen);
+  lua_rawseti(L, -2, 1);
+  push_args(L, m->types, m->data, m->size);
+  lua_rawseti(L, -2, 2);
+  lua_pushnumber(L, m->time);
+  lua_rawseti(L, -2, 3);
+  lua_rawseti(L, -2, ++r->k);
+  return 1;
+}
+
+// Get the packet data from the given stack index, which may either be a
+// string or a table of byte values (as delivered by Pd's network objects).
+// The latter needs to be copied into a temporary buffer *buf, which must be
+// freed by the caller.
+static const unsigned char *get_packet(lua_State *L, int i, size_t *n,
+				       unsigned char **buf)
+{
+  *buf = NULL;
+  if (lua_type(L, i) == LUA_TSTRING) {
+    return (const unsigned char*)lua_tolstring(L, i, n);
+  } else {
+    size_t j;
+    luaL_checktype(L, i, LUA_TTABLE);
+    *n = lua_rawlen(L, i);
+    if (!(*buf = malloc(*n ? *n : 1)))
+      luaL_error(L, "osc: out of memory");
+    for (j = 0; j < *n; j++) {
+      lua_rawgeti(L, i, j+1);
+      (*buf)[j] = lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    }
+    return *buf;
+  }
+}
+
+/* Encoder. ****************************************************************/
+
+// Determine the type tag of the Lua value at the given index. Like packOSC,
+// we send numbers with integer values as 'i', and other numbers as 'f'.
+static char type_tag(lua_State *L, int i)
+{
+  switch (lua_type(L, i)) {
+  case LUA_TNUMBER: {
+    lua_Number x = lua_tonumber(L, i);
+    if (lua_isinteger(L, i) ||
+	(x == (lua_Number)(int32_t)x && x >= -2147483648.0 && x <= 2147483647.0))
+      return 'i';
+    return 'f';
+  }
+  case LUA_TSTRING:
+    return 's';
+  case LUA_TBOOLEAN:
+    return lua_toboolean(L, i) ? 'T' : 'F';
+  default:
+    return 'N';
+  }
+}
+
+// Encode a message with the given address and atoms (a table at stack index
+// t) and push it onto the Lua stack as a string.
+static void encode_msg(lua_State *L, const char *path, int t)
+{
+  int i, nargs = lua_rawlen(L, t);
+  size_t pathlen = strlen(path), size, pos;
+  char *types = malloc(nargs+2);
+  unsigned char *buf;
+  if (!types) luaL_error(L, "osc: out of memory");
+  types[0] = ',';
+  size = pad4(pathlen+1);
+  for (i = 1; i <= nargs; i++) {
+    lua_rawgeti(L, t, i);
+    types[i] = type_tag(L, -1);
+    if (types[i] == 's')
+      size += pad4(lua_rawlen(L, -1)+1);
+    else if (types[i] == 'i' || types[i] == 'f')
+      size += 4;
+    lua_pop(L, 1);
+  }
+  types[nargs+1] = 0;
+  size += pad4(nargs+2);
+  if (!(buf = calloc(size, 1))) {
+    free(types);
+    luaL_error(L, "osc: out of memory");
+  }
+  memcpy(buf, path, pathlen);
+  pos = pad4(pathlen+1);
+  memcpy(buf+pos, types, nargs+1);
+  pos += pad4(nargs+2);
+  for (i = 1; i <= nargs; i++) {
+    lua_rawgeti(L, t, i);
+    switch (types[i]) {
+    case 'i':
+      put32(buf+pos, (uint32_t)(int32_t)lua_tonumber(L, -1));
+      pos += 4;
+      break;
+    case 'f': {
+      union { uint32_t i; float f; } u;
+      u.f = lua_tonumber(L, -1);
+      put32(buf+pos, u.i);
+      pos += 4;
+      break;
+    }
+    case 's': {
+      size_t len;
+      const char *s = lua_tolstring(L, -1, &len);
+      memcpy(buf+pos, s, len);
+      pos += pad4(len+1);
+      break;
+    }
+    default:
+      break;
+    }
+    lua_pop(L, 1);
+  }
+  assert(pos == size);
+  lua_pushlstring(L, (const char*)buf, size);
+  free(buf);
+  free(types);
+}
+
+/* Receiver. ***************************************************************/
+
+#if RECEIVER
+
+// A message in the ring. The address (if it isn't in the dispatcher) and
+// the type tags are stored as terminated strings in buf, followed by the
+// argument data.
+typedef struct {
+  int index;
+  double time;
+  size_t pathlen, types, data, size;	// offsets and sizes in buf
+  unsigned char buf[EVENT_SIZE];
+} event_t;
+
+typedef struct {
+  int fd;			// UDP socket, -1 if closed
+  int wake[2];			// pipe telling the thread to exit
+  int notify[2];		// pipe signaling pending messages
+  pthread_t thread;
+  int running;			// thread has been started
+  int dispatcher;		// registry reference to the dispatcher
+  const dispatcher_t *d;
+  event_t *ring;
+  // ring positions, written by the thread and the caller, respectively
+  atomic_size_t head, tail;
+  atomic_int signaled;		// notify pipe has been written to
+  atomic_ulong dropped;		// packets dropped because the ring was full
+  // destination of send()
+  int connected;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+} receiver_t;
+
+// Producer state while a packet is being stored in the ring. The messages of
+// a packet are only published once the entire packet has been parsed, so
+// that the caller always gets complete packets.
+typedef struct {
+  receiver_t *r;
+  size_t head, tail;
+} producer_t;
+
+static int put_event(void *arg, const msg_t *m)
+{
+  producer_t *pr = (producer_t*)arg;
+  size_t typeslen = strlen(m->types)+1;
+  size_t pathlen = m->index ? 0 : m->pathlen+1;
+  event_t *ev;
+  if (pr->head - pr->tail >= RING_SIZE ||
+      pathlen + typeslen + m->size > EVENT_SIZE)
+    return 0;
+  ev = &pr->r->ring[pr->head & (RING_SIZE-1)];
+  ev->index = m->index;
+  ev->time = m->time;
+  ev->pathlen = m->pathlen;
+  memcpy(ev->buf, m->path, pathlen);
+  ev->types = pathlen;
+  memcpy(ev->buf+pathlen, m->types, typeslen);
+  ev->data = pathlen+typeslen;
+  ev->size = m->size;
+  memcpy(ev->buf+ev->data, m->data, m->size);
+  pr->head++;
+  return 1;
+}
+
+static void store_packet(receiver_t *r, const unsigned char *p, size_t n)
+{
+  producer_t pr;
+  pr.r = r;
+  pr.head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  pr.tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (!parse_packet(r->d, p, n, 0, 0, put_event, &pr)) {
+    // malformed, or it didn't fit into the ring
+#if DEBUG
+    fprintf(stderr, "osc: dropped packet (%lu bytes)\n", (unsigned long)n);
+#endif
+    atomic_fetch_add(&r->dropped, 1);
+    return;
+  }
+  atomic_store_explicit(&r->head, pr.head, memory_order_release);
+  // wake up the caller, unless we already did
+  if (!atomic_exchange(&r->signaled, 1)) {
+    char c = 0;
+    if (write(r->notify[1], &c, 1) < 0) {}
+  }
+}
+
+static void *receiver_thread(void *arg)
+{
+  receiver_t *r = (receiver_t*)arg;
+  unsigned char *buf = malloc(DGRAM_MAX);
+  struct pollfd fds[2];
+  if (!buf) return NULL;
+  fds[0].fd = r->fd; fds[0].events = POLLIN;
+  fds[1].fd = r->wake[0]; fds[1].events = POLLIN;
+  for (;;) {
+    ssize_t n;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (fds[1].revents) break;
+    while ((n = recv(r->fd, buf, DGRAM_MAX, 0)) >= 0)
+      store_packet(r, buf, n);
+  }
+  free(buf);
+  return NULL;
+}
+
+static receiver_t *checkreceiver(lua_State *L, int i)
+{
+  receiver_t *r = (receiver_t*)luaL_checkudata(L, i, RECEIVER_T);
+  if (r->fd < 0) luaL_error(L, "osc: receiver has been closed");
+  return r;
+}
+
+static void closefd(int *fd)
+{
+  if (*fd >= 0) close(*fd);
+  *fd = -1;
+}
+
+static void close_receiver(lua_State *L, receiver_t *r)
+{
+  if (r->running) {
+    char c = 0;
+    if (write(r->wake[1], &c, 1) < 0) {}
+    pthread_join(r->thread, NULL);
+    r->running = 0;
+  }
+  closefd(&r->fd);
+  closefd(&r->wake[0]); closefd(&r->wake[1]);
+  closefd(&r->notify[0]); closefd(&r->notify[1]);
+  free(r->ring); r->ring = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, r->dispatcher);
+  r->dispatcher = LUA_NOREF;
+}
+
+static int pusherror(lua_State *L, const char *msg)
+{
+  lua_pushnil(L);
+  lua_pushstring(L, msg);
+  return 2;
+}
+
+#endif
+
+/* Lua API. ****************************************************************/
+
+// time(): current Unix time in seconds, with microsecond resolution.
+static int l_osc_time(lua_State *L)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  lua_pushnumber(L, tv.tv_sec + tv.tv_usec*1e-6);
+  return 1;
+}
+
+// encode(path, atoms): encode a single message, returns it as a string.
+static int l_osc_encode(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  if (lua_isnoneornil(L, 2)) {
+    lua_settop(L, 1);
+    lua_newtable(L);
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+  encode_msg(L, path, 2);
+  return 1;
+}
+
+// bundle(msgs [, time]): wrap a table of encoded messages (strings, as
+// returned by encode) into a bundle with the given timetag (Unix time in
+// seconds, 0 or nil means immediately), returns it as a string.
+static int l_osc_bundle(lua_State *L)
+{
+  int i, n;
+  size_t size = 16, pos = 16;
+  uint64_t tt;
+  unsigned char *buf;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  tt = ntp_timetag(luaL_optnumber(L, 2, 0));
+  n = lua_rawlen(L, 1);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      return luaL_error(L, "osc: bundle element #%d is not a string", i);
+    size += 4+lua_rawlen(L, -1);
+    lua_pop(L, 1);
+  }
+  if (!(buf = malloc(size)))
+    return luaL_error(L, "osc: out of memory");
+  memcpy(buf, "#bundle", 8);
+  put32(buf+8, tt>>32);
+  put32(buf+12, tt & 0xffffffff);
+  for (i = 1; i <= n; i++) {
+    size_t len;
+    const char *s;
+    lua_rawgeti(L, 1, i);
+    s = lua_tolstring(L, -1, &len);
+    put32(buf+pos, len);
+    memcpy(buf+pos+4, s, len);
+    pos += 4+len;
+    lua_pop(L, 1);
+  }
+  lua_pushlstring(L, (const char*)buf, size);
+  free(buf);
+  return 1;
+}
+
+// dispatcher(paths): compile a table of addresses into a hash table for use
+// with decode.
+static int l_osc_dispatcher(lua_State *L)
+{
+  int i, n;
+  dispatcher_t *d;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_rawlen(L, 1);
+  d = (dispatcher_t*)lua_newuserdata(L, sizeof(dispatcher_t));
+  d->size = 0; d->slots = NULL;
+  luaL_setmetatable(L, DISPATCHER);
+  if (n > 0) {
+    // keep the load factor below 1/2
+    for (d->size = 4; d->size < 2*(size_t)n; d->size *= 2) ;
+    if (!(d->slots = calloc(d->size, sizeof(slot_t))))
+      return luaL_error(L, "osc: out of memory");
+    for (i = 1; i <= n; i++) {
+      size_t len;
+      const char *s;
+      lua_rawgeti(L, 1, i);
+      s = luaL_checklstring(L, -1, &len);
+      insert(d, s, len, i);
+      lua_pop(L, 1);
+    }
+  }
+  return 1;
+}
+
+static int l_osc_dispatcher_gc(lua_State *L)
+{
+  dispatcher_t *d = (dispatcher_t*)luaL_checkudata(L, 1, DISPATCHER);
+  size_t i;
+  for (i = 0; i < d->size; i++)
+    free(d->slots[i].path);
+  free(d->slots);
+  d->slots = NULL; d->size = 0;
+  return 0;
+}
+
+// decode(packet [, dispatcher]): decode a packet (a string or a table of
+// byte values), returns a table of all messages in the packet as {key,
+// atoms, time} triples, see push_msg above. Returns nothing if the
+// packet is malformed.
+static int l_osc_decode(lua_State *L)
+{
+  size_t n;
+  unsigned char *buf;
+  const unsigned char *p;
+  const dispatcher_t *d = NULL;
+  result_t r;
+  int ok;
+  if (!lua_isnoneornil(L, 2))
+    d = (const dispatcher_t*)luaL_checkudata(L, 2, DISPATCHER);
+  p = get_packet(L, 1, &n, &buf);
+  lua_newtable(L);
+  r.L = L; r.k = 0;
+  ok = parse_packet(d, p, n, 0, 0, push_msg, &r);
+  free(buf);
+#if DEBUG
+  if (!ok) fprintf(stderr, "osc: malformed packet (%lu bytes)\n",
+		   (unsigned long)n);
+#endif
+  return ok ? 1 : 0;
+}
+
+#if RECEIVER
+
+// receiver(port, dispatcher): listen on the given UDP port on all interfaces
+// (any free port if 0), and decode the incoming packets on a separate
+// thread, using the given dispatcher. Returns the receiver, or nil and an
+// error message.
+static int l_osc_receiver(lua_State *L)
+{
+  int port = luaL_checkinteger(L, 1);
+  receiver_t *r;
+  struct sockaddr_in addr;
+  int err;
+  luaL_checkudata(L, 2, DISPATCHER);
+  r = (receiver_t*)lua_newuserdata(L, sizeof(receiver_t));
+  memset(r, 0, sizeof(receiver_t));
+  r->fd = r->wake[0] = r->wake[1] = r->notify[0] = r->notify[1] = -1;
+  r->dispatcher = LUA_NOREF;
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  atomic_init(&r->signaled, 0);
+  atomic_init(&r->dropped, 0);
+  luaL_setmetatable(L, RECEIVER_T);
+  lua_pushvalue(L, 2);
+  r->dispatcher = luaL_ref(L, LUA_REGISTRYINDEX);
+  r->d = (const dispatcher_t*)lua_touserdata(L, 2);
+  if (!(r->ring = malloc(RING_SIZE*sizeof(event_t))))
+    return luaL_error(L, "osc: out of memory");
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if ((r->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+      bind(r->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      pipe(r->wake) < 0 || pipe(r->notify) < 0)
+    goto error;
+  fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) | O_NONBLOCK);
+  fcntl(r->notify[0], F_SETFL, fcntl(r->notify[0], F_GETFL) | O_NONBLOCK);
+  fcntl(r->notify[1], F_SETFL, fcntl(r->notify[1], F_GETFL) | O_NONBLOCK);
+  if ((errno = pthread_create(&r->thread, NULL, receiver_thread, r)) != 0)
+    goto error;
+  r->running = 1;
+  return 1;
+ error:
+  err = errno;
+  close_receiver(L, r);
+  return pusherror(L, strerror(err));
+}
+
+static int l_receiver_close(lua_State *L)
+{
+  receiver_t *r = (receiver_t*)luaL_checkudata(L, 1, RECEIVER_T);
+  close_receiver(L, r);
+  return 0;
+}
+
+// receiver:poll(): take all messages received so far out of the ring.
+// Returns them as a table of {key, atoms, time} triples, like decode (nil if
+// there's nothing new, so that polling an idle receiver doesn't create any
+// garbage), and the number of packets dropped since the last call (because
+// they were malformed, or didn't fit into the ring).
+static int l_receiver_poll(lua_State *L)
+{
+  receiver_t *r = checkreceiver(L, 1);
+  size_t head, tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  result_t res;
+  char c[64];
+  // nothing new, and no notification to drain either (the pipe is only
+  // written to when signaled goes from 0 to 1)
+  if (atomic_load(&r->head) == tail && !atomic_load(&r->signaled)) {
+    lua_pushnil(L);
+    lua_pushinteger(L, atomic_exchange(&r->dropped, 0));
+    return 2;
+  }
+  // reset the notification before looking at the ring, so that we don't miss
+  // a packet arriving in the meantime
+  while (read(r->notify[0], c, sizeof(c)) > 0) ;
+  atomic_store(&r->signaled, 0);
+  head = atomic_load(&r->head);
+  lua_createtable(L, head-tail, 0);
+  res.L = L; res.k = 0;
+  for (; tail != head; tail++) {
+    const event_t *ev = &r->ring[tail & (RING_SIZE-1)];
+    msg_t m;
+    m.index = ev->index;
+    m.path = (const char*)ev->buf;
+    m.pathlen = ev->pathlen;
+    m.types = (const char*)ev->buf+ev->types;
+    m.data = ev->buf+ev->data;
+    m.size = ev->size;
+    m.time = ev->time;
+    push_msg(&res, &m);
+  }
+  atomic_store_explicit(&r->tail, tail, memory_order_release);
+  lua_pushinteger(L, atomic_exchange(&r->dropped, 0));
+  return 2;
+}
+
+// receiver:fd(): a file descriptor which becomes readable when there are new
+// messages, for callers which want to sleep until something arrives.
+static int l_receiver_fd(lua_State *L)
+{
+  receiver_t *r = checkreceiver(L, 1);
+  lua_pushinteger(L, r->notify[0]);
+  return 1;
+}
+
+// receiver:port(): the port we're listening on.
+static int l_receiver_port(lua_State *L)
+{
+  receiver_t *r = checkreceiver(L, 1);
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  if (getsockname(r->fd, (struct sockaddr*)&addr, &len) < 0)
+    return pusherror(L, strerror(errno));
+  lua_pushinteger(L, ntohs(addr.sin_port));
+  return 1;
+}
+
+// receiver:connect(host, port): set the destination of receiver:send(), so
+// that replies can go out on the same port. The host name is resolved right
+// away. Returns true, or nil and an error message.
+static int l_receiver_connect(lua_State *L)
+{
+  receiver_t *r = checkreceiver(L, 1);
+  const char *host = luaL_checkstring(L, 2);
+  const char *port = luaL_checkstring(L, 3);
+  struct addrinfo hints, *res;
+  int err;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if ((err = getaddrinfo(host, port, &hints, &res)) != 0)
+    return pusherror(L, gai_strerror(err));
+  memcpy(&r->addr, res->ai_addr, res->ai_addrlen);
+  r->addrlen = res->ai_addrlen;
+  r->connected = 1;
+  freeaddrinfo(res);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// receiver:disconnect(): forget the destination.
+static int l_receiver_disconnect(lua_State *L)
+{
+  receiver_t *r = checkreceiver(L, 1);
+  r->connected = 0;
+  return 0;
+}
+
+// receiver:send(data): send a datagram to the destination set with connect.
+// Returns true, or nil and an error message.
+static int l_receiver_send(lua_State *L)
+{
+  receiver_t *r = checkreceiver(L, 1);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  if (!r->connected)
+    return pusherror(L, "not connected");
+  if (sendto(r->fd, data, len, 0, (struct sockaddr*)&r->addr,
+	     r->addrlen) < 0)
+    return pusherror(L, strerror(errno));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static const struct luaL_Reg receiver_methods [] = {
+  {"close", l_receiver_close},
+  {"poll", l_receiver_poll},
+  {"fd", l_receiver_fd},
+  {"port", l_receiver_port},
+  {"connect", l_receiver_connect},
+  {"disconnect", l_receiver_disconnect},
+  {"send", l_receiver_send},
+  {NULL, NULL}  /* sentinel */
+};
+
+#endif
+
+static const struct luaL_Reg osc [] = {
+  {"time", l_osc_time},
+  {"encode", l_osc_encode},
+  {"bundle", l_osc_bundle},
+  {"dispatcher", l_osc_dispatcher},
+  {"decode", l_osc_decode},
+#if RECEIVER
+  {"receiver", l_osc_receiver},
+#endif
+  {NULL, NULL}  /* sentinel */
+};
+
+int luaopen_osc (lua_State *L) {
+  if (luaL_newmetatable(L, DISPATCHER)) {
+    lua_pushcfunction(L, l_osc_dispatcher_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_pop(L, 1);
+#if RECEIVER
+  if (luaL_newmetatable(L, RECEIVER_T)) {
+    lua_pushcfunction(L, l_receiver_close);
+    lua_setfield(L, -2, "__gc");
+    lua_newtable(L);
+    luaL_setfuncs(L, receiver_methods, 0);
+    lua_setfield(L, -2, "__index");
+  }
+  lua_pop(L, 1);
+#endif
+  luaL_newlib(L, osc);
+  return 1;
+}
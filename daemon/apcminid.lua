@@ -0,0 +1,187 @@
+-- Headless apcmini bridge daemon, runs the apcmini glue without Pd (Linux only)
+
+-- Author: Albert Gräf <aggraef@gmail.com>, Dept. of Music-Informatics,
+-- Johannes Gutenberg University (JGU) of Mainz, Germany, please check
+-- https://agraef.github.io/ for a list of my software.
+
+-- Distributed under the GPLv3+, please check the accompanying COPYING file
+-- for details.
+
+-- Usage: lua apcminid.lua [-v] [-p] [-n name] [-a host:port] [-r port]
+--   [-l msec] bridge
+
+-- Runs one of the bridges (`ardour` for the Ardour clip launcher, `koala`
+-- for the Koala sampler) without Pd, e.g., on a headless box. The apcmini
+-- external and its helper objects are loaded unchanged through a small
+-- pd-lua emulation (pdhost.lua), while the glue of the corresponding Pd
+-- patch is implemented in Lua (ardour.lua and koala.lua). MIDI goes through
+-- ALSA sequencer ports of our own, OSC through the osc module's threaded
+-- receiver, and the main loop sleeps in poll() until a MIDI message or an
+-- OSC packet arrives or the next timer is due, so there's no polling and no
+-- audio processing. The messages exchanged with the apcmini object and
+-- Ardour are exactly the same as in the Pd patches.
+
+-- Options:
+-- -v: verbose mode, print unrecognized OSC messages
+-- -p: profile all objects (cf. pdx.profile), the results are printed on exit
+-- -n name: ALSA client name (apcminid by default)
+-- -a host:port: Ardour's OSC address (ardour bridge only, by default Ardour
+--    is discovered via mDNS)
+-- -r port: UDP port for Ardour's OSC feedback (8000 by default)
+-- -l msec: send the OSC messages triggered by the APC mini in bundles which
+--    are timetagged with the time at which the MIDI input arrived, plus the
+--    given latency (ardour bridge only, off by default)
+
+-- This requires the hostio module in this directory and the Lua modules of
+-- the bridge (midicodec, osc, mdns, alsaseq), please check the Makefiles for
+-- details. The daemon connects its MIDI ports to the APC mini (and to Koala)
+-- automatically, like the alsaroute object in the koala-sampler patch.
+
+local dir = string.match(arg[0], "^(.*)/") or "."
+local libs = { dir, dir .. "/../lib", dir .. "/../ardour-clip-launcher",
+	       dir .. "/../koala-sampler" }
+for i = #libs, 1, -1 do
+   package.path = libs[i] .. "/?.lua;" .. package.path
+   package.cpath = libs[i] .. "/?.so;" .. package.cpath
+end
+
+local host = require 'pdhost'
+for i = 2, #libs do
+   table.insert(host.path, libs[i])
+end
+
+local hostio = require 'hostio'
+local midicodec = require 'midicodec'
+local pdx = require 'pdx'
+
+local function usage()
+   io.stderr:write("usage: apcminid [-v] [-p] [-n name] [-a host:port] ",
+		   "[-r port] [-l msec] ardour|koala\n")
+   os.exit(1)
+end
+
+-- options
+local opts = { name = "apcminid", port = 8000, verbose = false }
+local i = 1
+while arg[i] and string.sub(arg[i], 1, 1) == "-" do
+   local o = arg[i]
+   if o == "-v" then
+      opts.verbose = true
+   elseif o == "-p" then
+      opts.profile = true
+   elseif o == "-n" and arg[i+1] then
+      i = i + 1
+      opts.name = arg[i]
+   elseif o == "-a" and arg[i+1] then
+      i = i + 1
+      local h, p = string.match(arg[i], "^(.+):(%d+)$")
+      if not h then usage() end
+      opts.host, opts.hostport = h, tonumber(p)
+   elseif o == "-r" and tonumber(arg[i+1]) then
+      i = i + 1
+      opts.port = tonumber(arg[i])
+   elseif o == "-l" and tonumber(arg[i+1]) then
+      i = i + 1
+      opts.latency = tonumber(arg[i])
+   else
+      usage()
+   end
+   i = i + 1
+end
+if arg[i] ~= "ardour" and arg[i] ~= "koala" or arg[i+1] then
+   usage()
+end
+local bridge = require(arg[i])
+
+if opts.profile then
+   host.profile = true
+   pdx.clock = hostio.time
+end
+
+-- startup time, logical time is counted in msec from here
+local t0 = hostio.time()
+local function now()
+   return (hostio.time() - t0) * 1000
+end
+
+local midi, err = hostio.midi(opts.name, bridge.ports)
+if not midi then
+   io.stderr:write("apcminid: can't open ALSA sequencer: ", err, "\n")
+   os.exit(1)
+end
+
+-- one decoder per input port, so that messages don't get mixed up
+local decoders = {}
+for k = 1, #bridge.ports do
+   decoders[k] = midicodec.decoder()
+end
+
+-- file descriptors we wait on, and their handlers
+local handlers = {}
+
+-- the monotonic clock is also the timebase of the MIDI input timestamps
+local ctx = { host = host, opts = opts, time = hostio.time }
+
+-- send an SMMF message to the MIDI outputs; non-SMMF messages are ignored,
+-- so this can be hooked up to the apcmini object directly
+function ctx.midi_out(sel, atoms)
+   local bytes, port = midicodec.encode(sel, atoms, true)
+   if bytes and port < #bridge.ports then
+      midi:write(port, bytes)
+   end
+end
+
+-- call fn whenever the given file descriptor becomes readable
+function ctx.watch(fd, fn)
+   handlers[fd] = fn
+end
+
+function ctx.unwatch(fd)
+   handlers[fd] = nil
+end
+
+for _, fd in ipairs(midi:fds()) do
+   ctx.watch(fd, function()
+      for _, ev in ipairs(midi:read()) do
+	 local port, bytes, t = ev[1], ev[2], ev[3]
+	 local msgs = midicodec.decodebuf(decoders[port+1], bytes, port)
+	 for _, m in ipairs(msgs) do
+	    bridge.midi_in(m[1], m[2], t)
+	 end
+      end
+   end)
+end
+
+host.run_clocks(now())
+bridge.init(ctx)
+
+-- main loop: each event is processed in a logical tick of its own, after
+-- which the clocks scheduled during the tick fire (this flushes oscpack)
+hostio.signals()
+while true do
+   local fds = {}
+   for fd in pairs(handlers) do
+      table.insert(fds, fd)
+   end
+   local t = host.next_clock()
+   t = t and math.max(0, math.ceil(t - now())) or -1
+   local ready = hostio.wait(fds, t)
+   if not ready then break end
+   for fd in pairs(ready) do
+      if handlers[fd] then
+	 host.run_clocks(now())
+	 handlers[fd]()
+	 host.run_clocks(host.now)
+      end
+   end
+   host.run_clocks(now())
+end
+
+-- shut down cleanly, take down the display
+if opts.profile then
+   pd.send("pdluax", "profile", {})
+end
+bridge.fini()
+host.run_clocks(host.now)
+host.finalize()
+midi:close()
@@ -0,0 +1,285 @@
+-- Ardour clip launcher bridge for apcminid, the glue of
+-- ardour-clip-launcher.pd in Lua
+
+-- Author: Albert Gräf <aggraef@gmail.com>, Dept. of Music-Informatics,
+-- Johannes Gutenberg University (JGU) of Mainz, Germany, please check
+-- https://agraef.github.io/ for a list of my software.
+
+-- Distributed under the GPLv3+, please check the accompanying COPYING file
+-- for details.
+
+-- Usage: lua apcminid.lua [-a host:port] [-r port] [-l msec] ardour
+
+-- Does the same as the ardour-clip-launcher patch: The apcmini object drives
+-- the APC mini, its output is translated to OSC messages for Ardour, which
+-- are collected by oscpack and sent as one datagram per event, and Ardour's
+-- feedback is received and decoded on a separate thread (osc.receiver), and
+-- goes through oscunpack and clipcache to the grid.
+-- Ardour's address is either given with -a, or discovered with mdnsbrowser
+-- (the first Ardour instance found is used). The link is watched by osclink,
+-- which pings Ardour and fails over to the next Ardour instance found by the
+-- browser (or tries the same address again) if Ardour stops answering. The
+-- connection to Ardour is only made once the apcmini object reports that the
+-- device is ready, and the device handshake is restarted whenever the APC
+-- mini gets reconnected.
+
+local oscmod = require 'osc'
+
+local ardour = {}
+
+-- MIDI ports: APC mini control port
+ardour.ports = { "APC mini" }
+
+-- bank size (hard-coded for now, cf. bank.pd)
+local N = 8
+
+local host, ctx
+local apc, pack, unpack, cache, browser, route, link
+local sock
+-- connection status
+local connected = false
+-- whether the device handshake has finished, so that we may connect
+local started = false
+-- solo and mute states
+local solo, mute = {}, {}
+
+local function osc(path, atoms)
+   host.send(pack, 1, path, atoms or {})
+end
+
+-- pad colors for the clip states (0 = stopped, 1 = playing, -1 = empty,
+-- and the states predicted by clipcache, 2 = starting, 3 = stopping)
+local colors = { [0] = 5, [1] = 2, [-1] = 0, [2] = 1, [3] = 6 }
+
+local function set_column(i, states)
+   for j = 1, N do
+      local c = colors[states[j]]
+      if c then
+	 host.send(apc, 1, "pad", {i + N*(N-j), c})
+      end
+   end
+end
+
+local function clear_pads()
+   local empty = {}
+   for j = 1, N do
+      empty[j] = -1
+   end
+   for i = 0, N-1 do
+      set_column(i, empty)
+   end
+end
+
+-- Connection management. -------------------------------------------------
+
+local function connect(h, p)
+   local ok, err = sock:connect(h, tostring(p))
+   if not ok then
+      pd.post(string.format("apcminid: can't connect to %s:%s: %s",
+			    h, p, err))
+      return
+   end
+   if ctx.opts.verbose then
+      pd.post(string.format("apcminid: connecting to %s:%s", h, p))
+   end
+   connected = true
+   -- start from scratch, and ask Ardour to update the grid and bank status;
+   -- until the feedback arrives, the grid keeps showing what it has (the
+   -- last state from the snapshot at startup)
+   host.send(cache, 1, "clear")
+   osc("/set_surface/feedback", {32768})
+   host.send(apc, 1, "assign", {1})
+end
+
+local function lost()
+   if connected then
+      pd.post("apcminid: lost connection to Ardour")
+      connected = false
+      sock:disconnect()
+      host.send(apc, 1, "assign", {0})
+      host.send(apc, 1, "banks", {0, 0, 0, 0})
+   end
+end
+
+-- connect to Ardour, or start looking for it; osclink takes it from there
+local function start()
+   started = true
+   if ctx.opts.host then
+      host.send(link, 1, "connect", {ctx.opts.host, ctx.opts.hostport})
+   else
+      host.send(browser, 1, "float", {1})
+   end
+end
+
+-- OSC output. ------------------------------------------------------------
+
+-- output of the apcmini object
+local function control(sel, atoms)
+   ctx.midi_out(sel, atoms)
+   local a, b = atoms[1], atoms[2]
+   if sel == "ready" then
+      if not started then start() end
+   elseif sel == "time" then
+      -- arrival time of the following input, for the timetags
+      host.send(pack, 1, sel, atoms)
+   elseif sel == "scene" then
+      if b ~= 0 then host.send(cache, 1, "cue", {a}) end
+   elseif sel == "pad" then
+      -- clipcache shows the outcome right away, and tells Ardour
+      if b ~= 0 then host.send(cache, 1, "trigger", {a % N, N-1 - a // N}) end
+   elseif sel == "vol" or sel == "pan" then
+      local ctl = sel == "vol" and "fader" or "pan_stereo_position"
+      if a == N then
+	 osc("/master/" .. ctl, {b/127})
+      else
+	 osc(string.format("/strip/%s/%d", ctl, a+1), {b/127})
+      end
+   elseif sel == "bank-up" then
+      host.send(cache, 1, "step", {0, -N})
+   elseif sel == "bank-down" then
+      host.send(cache, 1, "step", {0, N})
+   elseif sel == "bank-left" then
+      host.send(cache, 1, "step", {-N, 0})
+   elseif sel == "bank-right" then
+      host.send(cache, 1, "step", {N, 0})
+   elseif sel == "stop" then
+      host.send(cache, 1, "stop", {a})
+   elseif sel == "stop-all" then
+      host.send(cache, 1, "stop", {})
+   elseif (sel == "solo" or sel == "mute") and type(a) == "number" then
+      -- toggle the switch, Ardour gets the new state first
+      local states = sel == "solo" and solo or mute
+      states[a] = 1 - (states[a] or 0)
+      osc(string.format("/strip/%s/%d", sel, a+1), {states[a]})
+      host.send(apc, 1, sel, {a, states[a]})
+   end
+end
+
+-- OSC input. -------------------------------------------------------------
+
+local function bank(atoms)
+   local cols, coloffs, rows, rowoffs = table.unpack(atoms)
+   local function b(x) return x and 1 or 0 end
+   host.send(apc, 1, "banks", {b(rowoffs > 0), b(rows > rowoffs+N),
+			       b(coloffs > 0), b(cols > coloffs+N)})
+end
+
+local function receive()
+   -- the receiver thread has decoded the packets already
+   local msgs, dropped = sock:poll()
+   if dropped > 0 and ctx.opts.verbose then
+      pd.post(string.format("apcminid: dropped %d OSC packets", dropped))
+   end
+   if msgs then
+      -- Ardour regularly sends feedback, which tells us that it's alive
+      host.send(link, 2, "alive")
+      host.send(unpack, 1, "events", msgs)
+   end
+end
+
+function ardour.init(c)
+   ctx, host = c, c.host
+   local paths = { "/trigger_grid/bank" }
+   for i = 0, N-1 do
+      table.insert(paths, string.format("/trigger_grid/%d/state", i))
+   end
+   local err
+   sock, err = oscmod.receiver(ctx.opts.port, oscmod.dispatcher(paths))
+   if not sock then
+      pd.post(string.format("apcminid: can't open UDP port %d: %s",
+			    ctx.opts.port, err))
+      os.exit(1)
+   end
+   ctx.watch(sock:fd(), receive)
+
+   apc = host.create("apcmini", {"ardour"})
+   host.connect(apc, 1, control)
+   pack = host.create("oscpack", {})
+   if ctx.opts.latency then
+      host.send(pack, 1, "latency", {ctx.opts.latency})
+   end
+   host.connect(pack, 1, function(sel, bytes)
+      if connected then
+	 sock:send(string.char(table.unpack(bytes)))
+      end
+   end)
+   -- same addresses as the receiver's dispatcher
+   unpack = host.create("oscunpack", paths)
+   cache = host.create("clipcache", {})
+   for i = 1, N+1 do
+      host.connect(unpack, i, cache, i)
+   end
+   host.connect(unpack, N+2, function(sel, atoms)
+      if ctx.opts.verbose and sel ~= "/transport_speed" then
+	 pd.post("osc: " .. sel .. " " .. table.concat(atoms, " "))
+      end
+   end)
+   host.connect(cache, 1, function(sel, atoms) bank(atoms) end)
+   for i = 0, N-1 do
+      host.connect(cache, i+2, function(sel, atoms)
+	 -- the progress comes first, then the slot states
+	 set_column(i, {table.unpack(atoms, 2)})
+      end)
+   end
+   host.connect(cache, N+2, pack, 1)
+
+   -- ALSA connections to the APC mini; when the device (re)appears, redo
+   -- the handshake so that it gets initialized right away
+   route = host.create("alsaroute", {ctx.opts.name .. "-route"})
+   host.connect(route, 1, function(sel, atoms)
+      if sel == "apc" and atoms[1] ~= 0 then
+	 host.send(apc, 1, "handshake")
+      end
+   end)
+   local me = ctx.opts.name
+   for _, r in ipairs {
+      {"APC MINI", 0, me, 0}, {"APC mini mk2", 0, me, 0},
+      {"apc", me, 0, "APC MINI", 0}, {"apc", me, 0, "APC mini mk2", 0} } do
+      host.send(route, 1, "route", r)
+   end
+
+   -- link monitor: pings go through oscpack, replies come from oscunpack
+   link = host.create("osclink", {})
+   host.connect(link, 1, function(sel, atoms)
+      if sel == "connect" then
+	 connect(atoms[1], atoms[2])
+      elseif sel == "disconnect" then
+	 lost()
+      end
+   end)
+   host.connect(link, 2, function(sel, atoms)
+      if connected then osc(sel, atoms) end
+   end)
+   host.connect(link, 4, function(sel, atoms)
+      if ctx.opts.verbose then
+	 pd.post("osclink: " .. sel .. " " .. table.concat(atoms, " "))
+      end
+   end)
+   host.connect(unpack, N+2, link, 2)
+   if not ctx.opts.host then
+      browser = host.create("mdnsbrowser", {"Pd"})
+      host.connect(browser, 1, link, 1)
+      host.connect(link, 3, browser, 1)
+   end
+end
+
+function ardour.midi_in(sel, atoms, t)
+   if t and ctx.opts.latency then
+      -- the arrival time goes through apcmini to oscpack, translated to the
+      -- Unix time used in OSC timetags
+      host.send(apc, 1, "time", {oscmod.time() - (ctx.time() - t)})
+   end
+   host.send(apc, 1, sel, atoms)
+end
+
+function ardour.fini()
+   -- save the state before taking down the display
+   host.send(apc, 1, "snapshot")
+   if connected then
+      host.send(apc, 1, "assign", {0})
+      host.send(apc, 1, "banks", {0, 0, 0, 0})
+   end
+   clear_pads()
+end
+
+return ardour
@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <alsa/asoundlib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#ifndef DEBUG
+// Set this to a nonzero value to enable debugging output.
+#define DEBUG 0
+#endif
+
+// Event sources for the apcminid daemon (Linux only): ALSA sequencer MIDI
+// ports, and a poll-based wait with a monotonic clock on these and any other
+// file descriptors (such as the notification fd of the osc module's
+// receiver, which takes care of the UDP side), so that the daemon can sleep
+// until the next event or timer is due, and handle each event as soon as it
+// arrives. MIDI data is exchanged as raw bytes,
+// which are translated to and from SMMF with the midicodec module.
+
+#define MIDI "hostio.midi"
+
+typedef struct {
+  snd_seq_t *seq;
+  int nports;
+  int *ports;
+  snd_midi_event_t *enc, *dec;
+  size_t encsize;
+  // real-time queue for timestamping the input (-1 if none)
+  int queue;
+} midi_t;
+
+static volatile sig_atomic_t interrupted = 0;
+
+/* Helper functions. *******************************************************/
+
+static int pusherror(lua_State *L, const char *msg)
+{
+  lua_pushnil(L);
+  lua_pushstring(L, msg);
+  return 2;
+}
+
+static midi_t *checkmidi(lua_State *L, int i)
+{
+  midi_t *m = (midi_t*)luaL_checkudata(L, i, MIDI);
+  if (!m->seq) luaL_error(L, "hostio: MIDI client has been closed");
+  return m;
+}
+
+static void on_signal(int sig)
+{
+  interrupted = 1;
+}
+
+/* Clock and wait. *********************************************************/
+
+static double monotonic(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// time(): monotonic time in seconds.
+static int l_time(lua_State *L)
+{
+  lua_pushnumber(L, monotonic());
+  return 1;
+}
+
+// signals(): catch SIGINT and SIGTERM, so that the daemon can shut down
+// cleanly; wait() returns nil once one of these has been received.
+static int l_signals(lua_State *L)
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  return 0;
+}
+
+// wait(fds, timeout): wait until one of the given file descriptors becomes
+// readable, or the timeout (msec, negative = none) expires. Returns a table
+// with the readable descriptors as keys, or nil if a signal was caught.
+static int l_wait(lua_State *L)
+{
+  struct pollfd buf[64], *pfd = buf;
+  int n, i, res, timeout;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  timeout = luaL_optnumber(L, 2, -1);
+  n = lua_rawlen(L, 1);
+  if (n > 64 && !(pfd = malloc(n*sizeof(struct pollfd))))
+    return luaL_error(L, "hostio: out of memory");
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 1, i+1);
+    pfd[i].fd = lua_tointeger(L, -1);
+    pfd[i].events = POLLIN;
+    pfd[i].revents = 0;
+    lua_pop(L, 1);
+  }
+  res = interrupted ? -1 : poll(pfd, n, timeout);
+  if (interrupted) {
+    if (pfd != buf) free(pfd);
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_newtable(L);
+  for (i = 0; res > 0 && i < n; i++) {
+    if (pfd[i].revents) {
+      lua_pushboolean(L, 1);
+      lua_rawseti(L, -2, pfd[i].fd);
+    }
+  }
+  if (pfd != buf) free(pfd);
+  return 1;
+}
+
+/* MIDI. *******************************************************************/
+
+static void set_timestamping(midi_t *m, int port)
+{
+  snd_seq_port_info_t *info;
+  snd_seq_port_info_alloca(&info);
+  if (snd_seq_get_port_info(m->seq, port, info) < 0) return;
+  snd_seq_port_info_set_timestamping(info, 1);
+  snd_seq_port_info_set_timestamp_real(info, 1);
+  snd_seq_port_info_set_timestamp_queue(info, m->queue);
+  snd_seq_set_port_info(m->seq, port, info);
+}
+
+// midi(name, portnames): open an ALSA sequencer client with the given name
+// and a duplex port for each of the given port names. The ports are numbered
+// from 0 in SMMF, i.e., MIDI channels 17-32 address the second port, etc.
+// Returns the client handle, or nil and an error message.
+static int l_midi(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  midi_t *m;
+  int i, n, err;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  n = lua_rawlen(L, 2);
+  if (n < 1) return luaL_error(L, "hostio: need at least one MIDI port");
+  m = (midi_t*)lua_newuserdata(L, sizeof(midi_t));
+  memset(m, 0, sizeof(midi_t));
+  m->queue = -1;
+  luaL_setmetatable(L, MIDI);
+  if (!(m->ports = calloc(n, sizeof(int))))
+    return luaL_error(L, "hostio: out of memory");
+  if ((err = snd_seq_open(&m->seq, "default", SND_SEQ_OPEN_DUPLEX,
+			  SND_SEQ_NONBLOCK)) < 0) {
+    m->seq = NULL;
+    return pusherror(L, snd_strerror(err));
+  }
+  snd_seq_set_client_name(m->seq, name);
+  for (i = 0; i < n; i++) {
+    const char *pname;
+    lua_rawgeti(L, 2, i+1);
+    pname = lua_tostring(L, -1);
+    m->ports[i] = snd_seq_create_simple_port
+      (m->seq, pname ? pname : name,
+       SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ|
+       SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
+       SND_SEQ_PORT_TYPE_MIDI_GENERIC|SND_SEQ_PORT_TYPE_APPLICATION);
+    lua_pop(L, 1);
+    if (m->ports[i] < 0) {
+      err = m->ports[i];
+      snd_seq_close(m->seq);
+      m->seq = NULL;
+      return pusherror(L, snd_strerror(err));
+    }
+    m->nports++;
+  }
+  // The sequencer stamps incoming events with the time of a real-time queue
+  // of ours, so that we know when they actually arrived, no matter when we
+  // get around to reading them. (If we can't get a queue, the events are
+  // stamped with the time they're read instead.)
+  if ((m->queue = snd_seq_alloc_named_queue(m->seq, name)) >= 0) {
+    for (i = 0; i < n; i++)
+      set_timestamping(m, m->ports[i]);
+    snd_seq_start_queue(m->seq, m->queue, NULL);
+    snd_seq_drain_output(m->seq);
+  }
+  // the encoder buffer grows as needed for large sysex messages
+  m->encsize = 256;
+  if (snd_midi_event_new(m->encsize, &m->enc) < 0 ||
+      snd_midi_event_new(0, &m->dec) < 0) {
+    snd_seq_close(m->seq);
+    m->seq = NULL;
+    return pusherror(L, "can't create MIDI event parser");
+  }
+  // we want complete messages, no running status
+  snd_midi_event_no_status(m->dec, 1);
+  return 1;
+}
+
+static int l_midi_close(lua_State *L)
+{
+  midi_t *m = (midi_t*)luaL_checkudata(L, 1, MIDI);
+  if (m->seq) {
+    if (m->queue >= 0) snd_seq_free_queue(m->seq, m->queue);
+    snd_seq_close(m->seq);
+    m->seq = NULL;
+  }
+  if (m->enc) snd_midi_event_free(m->enc);
+  if (m->dec) snd_midi_event_free(m->dec);
+  free(m->ports);
+  m->enc = m->dec = NULL;
+  m->ports = NULL;
+  return 0;
+}
+
+// midi:fds(): the file descriptors to wait on for MIDI input.
+static int l_midi_fds(lua_State *L)
+{
+  midi_t *m = checkmidi(L, 1);
+  int i, n = snd_seq_poll_descriptors_count(m->seq, POLLIN);
+  struct pollfd pfd[8];
+  if (n > 8) n = 8;
+  n = snd_seq_poll_descriptors(m->seq, pfd, n, POLLIN);
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_pushinteger(L, pfd[i].fd);
+    lua_rawseti(L, -2, i+1);
+  }
+  return 1;
+}
+
+// midi:client(): our client number, for setting up connections.
+static int l_midi_client(lua_State *L)
+{
+  midi_t *m = checkmidi(L, 1);
+  lua_pushinteger(L, snd_seq_client_id(m->seq));
+  return 1;
+}
+
+static int port_index(midi_t *m, int port)
+{
+  int i;
+  for (i = 0; i < m->nports; i++)
+    if (m->ports[i] == port) return i;
+  return -1;
+}
+
+// Current time of the input queue, or -1 if not available.
+static double queue_time(midi_t *m)
+{
+  snd_seq_queue_status_t *status;
+  const snd_seq_real_time_t *rt;
+  if (m->queue < 0) return -1;
+  snd_seq_queue_status_alloca(&status);
+  if (snd_seq_get_queue_status(m->seq, m->queue, status) < 0) return -1;
+  rt = snd_seq_queue_status_get_real_time(status);
+  return rt->tv_sec + rt->tv_nsec*1e-9;
+}
+
+// midi:read(): read all pending MIDI input without blocking. Returns a table
+// of {port, bytes, time} triples, where bytes is a string with the raw MIDI
+// bytes of a single message (sysex included), and time the time at which
+// the message arrived, on the same (monotonic) clock as time().
+static int l_midi_read(lua_State *L)
+{
+  midi_t *m = checkmidi(L, 1);
+  snd_seq_event_t *ev;
+  unsigned char tmp[16], *buf;
+  int k = 0, res;
+  // the queue time and the monotonic time at which we read the input, to
+  // translate the timestamps of the events to the monotonic clock
+  double now = monotonic(), qnow = queue_time(m);
+  lua_newtable(L);
+  while ((res = snd_seq_event_input(m->seq, &ev)) >= 0 || res == -ENOSPC) {
+    int port;
+    long n;
+    size_t size = sizeof(tmp);
+    if (res < 0) continue; // input overrun, some events were lost
+    port = port_index(m, ev->dest.port);
+    if (port < 0) continue;
+    buf = tmp;
+    if (ev->type == SND_SEQ_EVENT_SYSEX && ev->data.ext.len > size) {
+      size = ev->data.ext.len;
+      if (!(buf = malloc(size))) continue;
+    }
+    snd_midi_event_reset_decode(m->dec);
+    n = snd_midi_event_decode(m->dec, buf, size, ev);
+    if (n > 0) {
+      double t = now;
+      if (qnow >= 0 && ev->queue == m->queue &&
+	  (ev->flags & SND_SEQ_TIME_STAMP_MASK) == SND_SEQ_TIME_STAMP_REAL) {
+	double evt = ev->time.time.tv_sec + ev->time.time.tv_nsec*1e-9;
+	if (evt <= qnow) t = now - (qnow - evt);
+      }
+      lua_createtable(L, 3, 0);
+      lua_pushinteger(L, port);
+      lua_rawseti(L, -2, 1);
+      lua_pushlstring(L, (const char*)buf, n);
+      lua_rawseti(L, -2, 2);
+      lua_pushnumber(L, t);
+      lua_rawseti(L, -2, 3);
+      lua_rawseti(L, -2, ++k);
+    }
+    if (buf != tmp) free(buf);
+  }
+  return 1;
+}
+
+// midi:write(port, bytes): send a single MIDI message, given as a string of
+// raw MIDI bytes, on the given (0-based) port, to all subscribers. The
+// message goes out right away, bypassing the sequencer queues.
+static int l_midi_write(lua_State *L)
+{
+  midi_t *m = checkmidi(L, 1);
+  int port = luaL_checkinteger(L, 2);
+  size_t len;
+  const unsigned char *buf =
+    (const unsigned char*)luaL_checklstring(L, 3, &len);
+  snd_seq_event_t ev;
+  long n;
+  if (port < 0 || port >= m->nports)
+    return luaL_error(L, "hostio: bad MIDI port %d", port);
+  if (len > m->encsize) {
+    if (snd_midi_event_resize_buffer(m->enc, len) < 0)
+      return pusherror(L, "sysex message too large");
+    m->encsize = len;
+  }
+  snd_midi_event_reset_encode(m->enc);
+  while (len > 0) {
+    snd_seq_ev_clear(&ev);
+    n = snd_midi_event_encode(m->enc, buf, len, &ev);
+    if (n <= 0) break;
+    buf += n; len -= n;
+    if (ev.type == SND_SEQ_EVENT_NONE) continue;
+    snd_seq_ev_set_source(&ev, m->ports[port]);
+    snd_seq_ev_set_subs(&ev);
+    snd_seq_ev_set_direct(&ev);
+    snd_seq_event_output_direct(m->seq, &ev);
+#if DEBUG
+    fprintf(stderr, "hostio: MIDI out %d: event type %d\n", port, ev.type);
+#endif
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* Module. *****************************************************************/
+
+static const struct luaL_Reg midi_methods [] = {
+  {"close", l_midi_close},
+  {"fds", l_midi_fds},
+  {"client", l_midi_client},
+  {"read", l_midi_read},
+  {"write", l_midi_write},
+  {NULL, NULL}  /* sentinel */
+};
+
+static const struct luaL_Reg hostio [] = {
+  {"time", l_time},
+  {"signals", l_signals},
+  {"wait", l_wait},
+  {"midi", l_midi},
+  {NULL, NULL}  /* sentinel */
+};
+
+static void newclass(lua_State *L, const char *name, const luaL_Reg *methods,
+		     lua_CFunction gc)
+{
+  if (luaL_newmetatable(L, name)) {
+    lua_pushcfunction(L, gc);
+    lua_setfield(L, -2, "__gc");
+    lua_newtable(L);
+    luaL_setfuncs(L, methods, 0);
+    lua_setfield(L, -2, "__index");
+  }
+  lua_pop(L, 1);
+}
+
+int luaopen_hostio (lua_State *L) {
+  newclass(L, MIDI, midi_methods, l_midi_close);
+  luaL_newlib(L, hostio);
+  return 1;
+}
@@ -0,0 +1,163 @@
+-- Koala sampler bridge for apcminid, the glue of koala-sampler.pd in Lua
+
+-- Author: Albert Gräf <aggraef@gmail.com>, Dept. of Music-Informatics,
+-- Johannes Gutenberg University (JGU) of Mainz, Germany, please check
+-- https://agraef.github.io/ for a list of my software.
+
+-- Distributed under the GPLv3+, please check the accompanying COPYING file
+-- for details.
+
+-- Usage: lua apcminid.lua koala
+
+-- Does the same as the koala-sampler patch: The apcmini object drives the
+-- APC mini on the first MIDI port, the koalamap object translates the grid
+-- to Koala's pads and sequence launchers, and all MIDI for Koala goes out
+-- on the second port, using the channels in koalalayout.lua. The alsaroute
+-- object sets up the same ALSA connections as in the patch (adjust the
+-- client names below as needed). Once the apcmini object reports that the
+-- device is ready, the mk2 is switched to launchpad mode and the grid gets
+-- painted; the device handshake is restarted whenever the APC mini gets
+-- reconnected.
+
+local layout = require 'koalalayout'
+
+local koala = {}
+
+-- MIDI ports: APC mini control port, Koala (note port of the APC mini as
+-- input, for note mode)
+koala.ports = { "APC mini", "Koala" }
+
+local host, ctx
+local apc, map, route
+
+-- launchpad or drum mode, current bank, solo and mute states
+local mode, bank = 0, 0
+local solo, mute = {}, {}
+-- timer for painting the grid after the mode switch
+local clock
+
+-- send a message to Koala (2nd MIDI port), on the control channel
+local function ctl(sel, a, b)
+   ctx.midi_out(sel, {a, b, layout.ctlchan + 16})
+end
+
+local function show()
+   -- bank buttons: left/right arrows show which banks are available
+   local l, r = 0, 1
+   if bank == 1 then
+      l, r = 1, 1
+   elseif bank == 2 then
+      l, r = 1, 0
+   end
+   host.send(apc, 1, "banks", {0, 0, l, r})
+   if mode == 0 then
+      host.send(map, 1, "show", {0, bank})
+   elseif mode == 2 then
+      host.send(map, 1, "show", {2})
+   end
+end
+
+-- toggle a solo or mute switch; Koala gets the control change first, then
+-- the apcmini object updates the button
+local function toggle(sel, states, base, k)
+   if type(k) ~= "number" then return end
+   states[k] = 1 - (states[k] or 0)
+   ctl("ctl", states[k]*127, base + k)
+   host.send(apc, 1, sel, {k, states[k]})
+end
+
+-- output of the apcmini object
+local function control(sel, atoms)
+   -- SMMF output goes to the APC mini
+   ctx.midi_out(sel, atoms)
+   local a, b = atoms[1], atoms[2]
+   if sel == "ready" then
+      -- force the mk2 to launchpad mode, in case it's in note or drum mode,
+      -- give it some time to switch, then paint the grid
+      host.send(apc, 1, "mode", {0})
+      clock:delay(100)
+   elseif sel == "mode" then
+      mode = a
+      if mode == 0 or mode == 2 then
+	 show()
+      end
+   elseif sel == "bank-right" or sel == "bank-left" then
+      bank = (bank + (sel == "bank-right" and 1 or -1)) % 3
+      show()
+   elseif sel == "pad" then
+      host.send(map, 1, "bank", {bank})
+      host.send(map, 1, "list", {a, b})
+   elseif sel == "vol" or sel == "pan" or sel == "send" or sel == "dev" then
+      local m = ({vol = 0, pan = 1, send = 2, dev = 3})[sel]
+      ctl("ctl", b, m*9 + 21 + a)
+   elseif sel == "solo" then
+      toggle("solo", solo, 57, a)
+   elseif sel == "mute" then
+      toggle("mute", mute, 65, a)
+   elseif sel == "scene" then
+      ctl("note", a + 72, b)
+   end
+end
+
+function koala.init(c)
+   ctx, host = c, c.host
+   apc = host.create("apcmini", {"koala"})
+   map = host.create("koalamap", {})
+   host.connect(apc, 1, control)
+   host.connect(map, 1, function(sel, atoms)
+      if sel == "pad" or sel == "remap" then
+	 host.send(apc, 1, sel, atoms)
+      else
+	 ctx.midi_out(sel, atoms)
+      end
+   end)
+   host.send(map, 1, "chan", {layout.chan})
+   -- the apcmini object plays the notes of note and drum mode on Koala's
+   -- port itself
+   host.send(map, 1, "remap")
+   host.send(apc, 1, "remap", {"note", "chan", 17})
+   route = host.create("alsaroute", {ctx.opts.name .. "-route"})
+   host.connect(route, 1, function(sel, atoms)
+      if sel == "notes" then
+	 -- while the APC mini's note port is connected to Koala directly,
+	 -- we don't send these notes ourselves
+	 host.send(apc, 1, "remap", atoms[1] ~= 0 and {"note", "off"} or
+		   {"note", "chan", 17})
+      elseif sel == "apc" and atoms[1] ~= 0 then
+	 -- the device (re)appeared, redo the handshake
+	 host.send(apc, 1, "handshake")
+      end
+   end)
+   local me = ctx.opts.name
+   for _, r in ipairs {
+      {"APC MINI", 0, me, 0}, {"APC mini mk2", 0, me, 0},
+      {"APC mini mk2", 1, me, 1},
+      {"apc", me, 0, "APC MINI", 0}, {"apc", me, 0, "APC mini mk2", 0},
+      {me, 1, "RtMidi Input Client", 0},
+      {"notes", "APC mini mk2", 1, "RtMidi Input Client", 0} } do
+      host.send(route, 1, "route", r)
+   end
+   host.send(route, 1, "exclusive", {"RtMidi Input Client", 0})
+   clock = pd.Clock:new():register(koala, "startup")
+end
+
+function koala.startup()
+   show()
+end
+
+function koala.midi_in(sel, atoms)
+   host.send(apc, 1, sel, atoms)
+end
+
+-- save the state, then take down the display
+function koala.fini()
+   host.send(apc, 1, "snapshot")
+   for n = 0, 63 do
+      host.send(apc, 1, "pad", {n, 0, 0})
+   end
+   host.send(apc, 1, "key", {0})
+   host.send(apc, 1, "assign", {0})
+   host.send(apc, 1, "banks", {0, 0, 0, 0})
+end
+
+return koala
@@ -0,0 +1,287 @@
+-- Minimal pd-lua host for running the apcmini externals without Pd
+
+-- Author: Albert Gräf <aggraef@gmail.com>, Dept. of Music-Informatics,
+-- Johannes Gutenberg University (JGU) of Mainz, Germany, please check
+-- https://agraef.github.io/ for a list of my software.
+
+-- Distributed under the GPLv3+, please check the accompanying COPYING file
+-- for details.
+
+-- Usage: local host = require 'pdhost'
+
+-- This module provides just enough of the pd-lua API (pd.Class, pd.Clock,
+-- pd.Receive, pd.post, etc.) to load the .pd_lua objects of this package
+-- unchanged and run them in a plain Lua interpreter. Objects are created with
+-- host.create() and wired up with host.connect(), like in a Pd patch;
+-- messages are sent to an inlet with host.send(). Timers are handled by
+-- host.run_clocks(), which the main loop calls with the current time; as in
+-- Pd, a clock delayed by 0 fires at the end of the current logical tick,
+-- i.e., after the message that scheduled it has been processed.
+
+-- Messages follow the same calling conventions as in pd-lua: `bang` calls the
+-- inlet method without arguments, `float` and `symbol` pass the value, all
+-- other selectors pass the atoms table, and if there's no method for the
+-- selector, the generic in_N method is called with selector and atoms.
+
+local host = {}
+
+-- search path for .pd_lua files
+host.path = {}
+
+-- logical time (msec)
+host.now = 0
+
+-- set this to profile all objects (cf. pdx.profile)
+host.profile = false
+
+-- registered classes, active clocks and receivers, and all objects created
+-- so far (in creation order, for finalization)
+local classes = {}
+local clocks = {}
+local receivers = {}
+local objects = {}
+
+-- sequence number of delayed clocks, so that clocks due at the same time
+-- fire in the order in which they were scheduled
+local seqno = 0
+
+pd = {}
+
+-- scripts are loaded through pdx' bytecode cache, so that they don't need to
+-- be compiled again at each startup
+local pdx = require 'pdx'
+
+function pd.post(s)
+   io.stderr:write(s, "\n")
+end
+
+function pd.error(s)
+   io.stderr:write("error: ", s, "\n")
+end
+
+-- Classes. ---------------------------------------------------------------
+
+pd.Class = {}
+pd.Class.__index = pd.Class
+
+function pd.Class:new()
+   local c = {}
+   c.__index = c
+   return setmetatable(c, self)
+end
+
+function pd.Class:register(name)
+   -- re-registering a class (e.g., when reloading) returns the existing one,
+   -- so that the script's methods are updated in place
+   if classes[name] then
+      return classes[name]
+   end
+   self._name = name
+   classes[name] = self
+   return self
+end
+
+function pd.Class:outlet(n, sel, atoms)
+   local conns = self._conns[n]
+   if not conns then return end
+   for _, c in ipairs(conns) do
+      if type(c[1]) == "function" then
+	 c[1](sel, atoms)
+      else
+	 -- objects may modify their arguments, so each one gets a copy
+	 host.send(c[1], c[2], sel, {table.unpack(atoms)})
+      end
+   end
+end
+
+function pd.Class:dofile(file)
+   return dofile(file)
+end
+
+function pd.Class:dofilex(file)
+   return pdx.dofile(file)
+end
+
+function pd.Class:error(s)
+   pd.error(string.format("%s: %s", self._name, s))
+end
+
+-- Clocks. ----------------------------------------------------------------
+
+pd.Clock = {}
+pd.Clock.__index = pd.Clock
+
+function pd.Clock:new()
+   return setmetatable({}, self)
+end
+
+function pd.Clock:register(obj, meth)
+   self.obj, self.meth = obj, meth
+   return self
+end
+
+function pd.Clock:delay(ms)
+   seqno = seqno + 1
+   self.time, self.seqno = host.now + math.max(0, ms), seqno
+   clocks[self] = true
+end
+
+function pd.Clock:unset()
+   clocks[self] = nil
+end
+
+function pd.Clock:destruct()
+   clocks[self] = nil
+   self.obj = nil
+end
+
+-- Receivers. -------------------------------------------------------------
+
+pd.Receive = {}
+pd.Receive.__index = pd.Receive
+
+function pd.Receive:new()
+   return setmetatable({}, self)
+end
+
+function pd.Receive:register(obj, name, meth)
+   self.obj, self.name, self.meth = obj, name, meth
+   receivers[name] = receivers[name] or {}
+   receivers[name][self] = true
+   return self
+end
+
+function pd.Receive:destruct()
+   if self.name and receivers[self.name] then
+      receivers[self.name][self] = nil
+   end
+   self.obj = nil
+end
+
+function pd.send(name, sel, atoms)
+   for r in pairs(receivers[name] or {}) do
+      r.obj[r.meth](r.obj, sel, atoms)
+   end
+end
+
+-- Objects. ---------------------------------------------------------------
+
+-- Load the class with the given name from a .pd_lua file on the search path,
+-- unless it's already loaded.
+function host.load(name)
+   if classes[name] then
+      return classes[name]
+   end
+   for _, dir in ipairs(host.path) do
+      local file = dir .. "/" .. name .. ".pd_lua"
+      local fp = io.open(file)
+      if fp then
+	 fp:close()
+	 pdx.dofile(file)
+	 if classes[name] then
+	    classes[name]._scriptname = file
+	    return classes[name]
+	 end
+      end
+   end
+   error(string.format("pdhost: can't load class %s", name))
+end
+
+-- Create an object of the given class with the given creation arguments.
+-- Returns the object, or nil if it refused to initialize.
+function host.create(name, atoms)
+   local class = host.load(name)
+   local obj = setmetatable({}, class)
+   obj._name = name
+   obj._scriptname = class._scriptname
+   obj._conns = {}
+   if not obj:initialize(name, atoms or {}) then
+      return nil
+   end
+   if obj.postinitialize then
+      obj:postinitialize()
+   end
+   if host.profile then
+      pdx.profile(obj)
+   end
+   table.insert(objects, obj)
+   return obj
+end
+
+-- Connect outlet n of obj to the given inlet of another object. Instead of an
+-- object, a function may be given which receives the selector and atoms of
+-- each message.
+function host.connect(obj, n, dest, inlet)
+   obj._conns[n] = obj._conns[n] or {}
+   table.insert(obj._conns[n], {dest, inlet or 1})
+end
+
+-- Send a message to the given inlet of an object.
+function host.send(obj, inlet, sel, atoms)
+   atoms = atoms or {}
+   local m = obj["in_" .. inlet .. "_" .. sel]
+   if m then
+      if sel == "bang" then
+	 return m(obj)
+      elseif sel == "float" or sel == "symbol" then
+	 return m(obj, atoms[1])
+      else
+	 return m(obj, atoms)
+      end
+   end
+   m = obj["in_" .. inlet]
+   if m then
+      return m(obj, sel, atoms)
+   end
+   pd.post(string.format("%s: no method for '%s' on inlet %d",
+			 obj._name, sel, inlet))
+end
+
+-- Finalize all objects, in reverse creation order.
+function host.finalize()
+   for i = #objects, 1, -1 do
+      local obj = objects[i]
+      if obj.finalize then
+	 obj:finalize()
+      end
+   end
+   objects = {}
+end
+
+-- Clocks. ----------------------------------------------------------------
+
+-- Advance the logical time to now (msec) and fire all clocks which are due,
+-- including those scheduled by the callbacks for the same time.
+function host.run_clocks(now)
+   while true do
+      local next
+      for c in pairs(clocks) do
+	 if c.time <= now and
+	    (not next or c.time < next.time or
+	     c.time == next.time and c.seqno < next.seqno) then
+	    next = c
+	 end
+      end
+      if not next then break end
+      clocks[next] = nil
+      -- callbacks see the time at which the clock was due
+      host.now = next.time
+      if next.obj then
+	 next.obj[next.meth](next.obj)
+      end
+   end
+   host.now = now
+end
+
+-- The time at which the next clock is due, or nil if there are none.
+function host.next_clock()
+   local t
+   for c in pairs(clocks) do
+      if not t or c.time < t then
+	 t = c.time
+      end
+   end
+   return t
+end
+
+return host
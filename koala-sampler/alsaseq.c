@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <alsa/asoundlib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#ifndef DEBUG
+// Set this to a nonzero value to enable debugging output.
+#define DEBUG 0
+#endif
+
+// ALSA sequencer port subscriptions for Lua (Linux only). This lets the
+// koala-sampler patch set up and maintain the MIDI connections between the
+// APC mini, Pd and Koala by itself, instead of having to run aj-snapshot
+// each time Koala is launched. Connections between two ports are handled
+// entirely by the ALSA sequencer in the kernel, so MIDI data routed this way
+// never goes through Pd.
+
+// We also subscribe to the system announce port, so that we get notified
+// when clients and ports come and go, and the connections can be
+// reestablished as needed.
+
+#define SEQ "alsaseq.seq"
+
+typedef struct {
+  snd_seq_t *seq;
+  int port; // our own port, receives the announcements
+} seq_t;
+
+/* Helper functions. *******************************************************/
+
+static seq_t *checkseq(lua_State *L, int i)
+{
+  seq_t *s = (seq_t*)luaL_checkudata(L, i, SEQ);
+  if (!s->seq) luaL_error(L, "alsaseq: sequencer has been closed");
+  return s;
+}
+
+static void checkaddr(lua_State *L, int i, snd_seq_addr_t *addr)
+{
+  addr->client = luaL_checkinteger(L, i);
+  addr->port = luaL_checkinteger(L, i+1);
+}
+
+static int pusherror(lua_State *L, int err)
+{
+  lua_pushnil(L);
+  lua_pushstring(L, snd_strerror(err));
+  return 2;
+}
+
+/* Lua API. ****************************************************************/
+
+// open(name): open the sequencer as a client with the given name. Returns
+// the sequencer handle, or nil and an error message.
+static int l_open(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  seq_t *s = (seq_t*)lua_newuserdata(L, sizeof(seq_t));
+  int err;
+  s->seq = NULL; s->port = -1;
+  luaL_setmetatable(L, SEQ);
+  if ((err = snd_seq_open(&s->seq, "default", SND_SEQ_OPEN_DUPLEX,
+			  SND_SEQ_NONBLOCK)) < 0) {
+    s->seq = NULL;
+    return pusherror(L, err);
+  }
+  snd_seq_set_client_name(s->seq, name);
+  s->port = snd_seq_create_simple_port
+    (s->seq, "announce", SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_NO_EXPORT,
+     SND_SEQ_PORT_TYPE_APPLICATION);
+  if (s->port < 0 ||
+      (err = snd_seq_connect_from(s->seq, s->port, SND_SEQ_CLIENT_SYSTEM,
+				  SND_SEQ_PORT_SYSTEM_ANNOUNCE)) < 0) {
+    err = s->port < 0 ? s->port : err;
+    snd_seq_close(s->seq);
+    s->seq = NULL;
+    return pusherror(L, err);
+  }
+  return 1;
+}
+
+// close(seq): close the sequencer. This is also done automatically when the
+// handle is garbage-collected.
+static int l_close(lua_State *L)
+{
+  seq_t *s = (seq_t*)luaL_checkudata(L, 1, SEQ);
+  if (s->seq) {
+    snd_seq_close(s->seq);
+    s->seq = NULL;
+  }
+  return 0;
+}
+
+// client(seq, name): look up a client by name, returns its number or nil if
+// there's no such client.
+static int l_client(lua_State *L)
+{
+  seq_t *s = checkseq(L, 1);
+  const char *name = luaL_checkstring(L, 2);
+  snd_seq_client_info_t *info;
+  snd_seq_client_info_alloca(&info);
+  snd_seq_client_info_set_client(info, -1);
+  while (snd_seq_query_next_client(s->seq, info) >= 0) {
+    if (strcmp(snd_seq_client_info_get_name(info), name) == 0) {
+      lua_pushinteger(L, snd_seq_client_info_get_client(info));
+      return 1;
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+// port(seq, client, port): check whether the given port exists.
+static int l_port(lua_State *L)
+{
+  seq_t *s = checkseq(L, 1);
+  snd_seq_addr_t addr;
+  snd_seq_port_info_t *info;
+  checkaddr(L, 2, &addr);
+  snd_seq_port_info_alloca(&info);
+  lua_pushboolean(L, snd_seq_get_any_port_info(s->seq, addr.client,
+					       addr.port, info) >= 0);
+  return 1;
+}
+
+static void init_subs(snd_seq_port_subscribe_t *subs,
+		      const snd_seq_addr_t *src, const snd_seq_addr_t *dst)
+{
+  snd_seq_port_subscribe_set_sender(subs, src);
+  snd_seq_port_subscribe_set_dest(subs, dst);
+  snd_seq_port_subscribe_set_queue(subs, 0);
+  snd_seq_port_subscribe_set_exclusive(subs, 0);
+  snd_seq_port_subscribe_set_time_update(subs, 0);
+  snd_seq_port_subscribe_set_time_real(subs, 0);
+}
+
+// connected(seq, sclient, sport, dclient, dport): check whether the given
+// ports are connected.
+static int l_connected(lua_State *L)
+{
+  seq_t *s = checkseq(L, 1);
+  snd_seq_addr_t src, dst;
+  snd_seq_port_subscribe_t *subs;
+  checkaddr(L, 2, &src);
+  checkaddr(L, 4, &dst);
+  snd_seq_port_subscribe_alloca(&subs);
+  init_subs(subs, &src, &dst);
+  lua_pushboolean(L, snd_seq_get_port_subscription(s->seq, subs) >= 0);
+  return 1;
+}
+
+// connect(seq, sclient, sport, dclient, dport): connect the given ports.
+// Returns true, or nil and an error message.
+static int l_connect(lua_State *L)
+{
+  seq_t *s = checkseq(L, 1);
+  snd_seq_addr_t src, dst;
+  snd_seq_port_subscribe_t *subs;
+  int err;
+  checkaddr(L, 2, &src);
+  checkaddr(L, 4, &dst);
+  snd_seq_port_subscribe_alloca(&subs);
+  init_subs(subs, &src, &dst);
+  if ((err = snd_seq_subscribe_port(s->seq, subs)) < 0 && err != -EBUSY)
+    // EBUSY means that the ports are already connected, which is fine
+    return pusherror(L, err);
+#if DEBUG
+  fprintf(stderr, "alsaseq: connect %d:%d -> %d:%d\n",
+	  src.client, src.port, dst.client, dst.port);
+#endif
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// disconnect(seq, sclient, sport, dclient, dport): disconnect the given
+// ports. Returns true, or nil and an error message.
+static int l_disconnect(lua_State *L)
+{
+  seq_t *s = checkseq(L, 1);
+  snd_seq_addr_t src, dst;
+  snd_seq_port_subscribe_t *subs;
+  int err;
+  checkaddr(L, 2, &src);
+  checkaddr(L, 4, &dst);
+  snd_seq_port_subscribe_alloca(&subs);
+  init_subs(subs, &src, &dst);
+  if ((err = snd_seq_unsubscribe_port(s->seq, subs)) < 0)
+    return pusherror(L, err);
+#if DEBUG
+  fprintf(stderr, "alsaseq: disconnect %d:%d -> %d:%d\n",
+	  src.client, src.port, dst.client, dst.port);
+#endif
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// senders(seq, client, port): list the ports connected to the given
+// (destination) port, as a table of {client, port} pairs.
+static int l_senders(lua_State *L)
+{
+  seq_t *s = checkseq(L, 1);
+  snd_seq_addr_t addr;
+  snd_seq_query_subscribe_t *query;
+  int k = 0;
+  checkaddr(L, 2, &addr);
+  snd_seq_query_subscribe_alloca(&query);
+  snd_seq_query_subscribe_set_root(query, &addr);
+  snd_seq_query_subscribe_set_type(query, SND_SEQ_QUERY_SUBS_WRITE);
+  snd_seq_query_subscribe_set_index(query, 0);
+  lua_newtable(L);
+  while (snd_seq_query_port_subscribers(s->seq, query) >= 0) {
+    const snd_seq_addr_t *a = snd_seq_query_subscribe_get_addr(query);
+    lua_createtable(L, 2, 0);
+    lua_pushinteger(L, a->client);
+    lua_rawseti(L, -2, 1);
+    lua_pushinteger(L, a->port);
+    lua_rawseti(L, -2, 2);
+    lua_rawseti(L, -2, ++k);
+    snd_seq_query_subscribe_set_index
+      (query, snd_seq_query_subscribe_get_index(query) + 1);
+  }
+  return 1;
+}
+
+// changes(seq): drain the pending announcements without blocking, returns
+// the number of changes (clients or ports starting or exiting, connections
+// being made or broken) since the last call.
+static int l_changes(lua_State *L)
+{
+  seq_t *s = checkseq(L, 1);
+  snd_seq_event_t *ev;
+  int n = 0;
+  while (snd_seq_event_input(s->seq, &ev) >= 0) {
+    switch (ev->type) {
+    case SND_SEQ_EVENT_CLIENT_START:
+    case SND_SEQ_EVENT_CLIENT_EXIT:
+    case SND_SEQ_EVENT_CLIENT_CHANGE:
+    case SND_SEQ_EVENT_PORT_START:
+    case SND_SEQ_EVENT_PORT_EXIT:
+    case SND_SEQ_EVENT_PORT_CHANGE:
+    case SND_SEQ_EVENT_PORT_SUBSCRIBED:
+    case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+      n++;
+      break;
+    default:
+      break;
+    }
+  }
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+static const struct luaL_Reg alsaseq [] = {
+  {"open", l_open},
+  {"close", l_close},
+  {"client", l_client},
+  {"port", l_port},
+  {"connected", l_connected},
+  {"connect", l_connect},
+  {"disconnect", l_disconnect},
+  {"senders", l_senders},
+  {"changes", l_changes},
+  {NULL, NULL}  /* sentinel */
+};
+
+int luaopen_alsaseq (lua_State *L) {
+  if (luaL_newmetatable(L, SEQ)) {
+    lua_pushcfunction(L, l_close);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_pop(L, 1);
+  luaL_newlib(L, alsaseq);
+  return 1;
+}
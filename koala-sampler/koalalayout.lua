@@ -0,0 +1,200 @@
+-- Layout of the APC mini grid for the koala-sampler patch
+
+-- Author: Albert Gräf <aggraef@gmail.com>, Dept. of Music-Informatics,
+-- Johannes Gutenberg University (JGU) of Mainz, Germany, please check
+-- https://agraef.github.io/ for a list of my software.
+
+-- Distributed under the GPLv3+, please check the accompanying COPYING file
+-- for details.
+
+-- Usage: local layout = require 'koalalayout'
+
+-- This module describes how the pads of the APC mini map to the pads and
+-- sequence launchers of Koala, in one place. layout.compile() turns this
+-- into the lookup tables used by the koalamap object, and layout.json()
+-- generates the corresponding MIDI mapping for Koala (midiMapping.json).
+-- If you change anything here, run `make mapping` in this directory to
+-- regenerate midiMapping.json, and copy it to Koala's settings folder.
+
+local layout = {}
+
+-- Base channel of the grid (bank A, subsequent banks are on subsequent
+-- channels), and the channel of the other controls (cf. chan10 and chan16
+-- in the patch).
+layout.chan = 10
+layout.ctlchan = 16
+
+-- Number of banks of each kind in Koala.
+layout.banks = 4
+
+-- The kinds of Koala controls on the grid, each bank of which occupies a
+-- block of rows x cols pads, with consecutive notes starting at the given
+-- base note from the bottom-left pad. Koala numbers the pads in each block
+-- from the top-left pad instead. Colors are the default bank colors.
+layout.kinds = {
+   pads = { note = 36, rows = 4, cols = 4, colors = {33, 41, 4, 12} },
+   seqs = { note = 52, rows = 2, cols = 4, colors = {34, 42, 2, 82} },
+}
+
+-- The grid layouts of the different modes, each region given as {row, col,
+-- kind, bank}, where row and col denote the bottom-left pad of the region
+-- (rows are counted from the bottom). The pad banks in launchpad mode are
+-- relative to the current bank, so that the pads always show two adjacent
+-- banks, which can be switched with the bank buttons. Drum mode (mk2 only)
+-- shows all four pad banks; the apcmini object reports these pads as 64-127,
+-- hence the offset. led is the channel of the color spec (cf. apcmini).
+layout.grid = {
+   [0] = { offset = 0, led = 7,
+	   {0, 0, "pads", 0}, {0, 4, "pads", 1},
+	   {6, 0, "seqs", 0}, {6, 4, "seqs", 1},
+	   {4, 0, "seqs", 2}, {4, 4, "seqs", 3} },
+   [2] = { offset = 64, led = 10,
+	   {0, 0, "pads", 0}, {0, 4, "pads", 1},
+	   {4, 0, "pads", 2}, {4, 4, "pads", 3} },
+}
+
+-- The other controls, as {type, number, identifier [, channel]}, where type
+-- is "note" for buttons, "cc" for faders, and "ccbutton" for buttons sending
+-- control changes. These are all on the control channel unless a channel is
+-- given. A list of identifiers denotes controls with consecutive numbers.
+local function controls(list)
+   local t = {}
+   for _, c in ipairs(list) do
+      if type(c[3]) == "table" then
+	 -- consecutive numbers
+	 for i, name in ipairs(c[3]) do
+	    table.insert(t, {c[1], c[2]+i-1, name})
+	 end
+      else
+	 table.insert(t, c)
+      end
+   end
+   return t
+end
+
+layout.controls = controls {
+   {"note", 73, "solo"}, {"note", 74, "mute"},
+   {"note", 78, "rec"}, {"note", 79, "play"},
+   {"cc", 21, {"mixer vol 0", "mixer vol 1", "mixer vol 2", "mixer vol 3",
+	       "mixer vol -1"}},
+   {"cc", 30, {"VOL", "PITCH", "PAN"}},
+   {"cc", 36, {"sampleStart", "sampleLength"}},
+   {"cc", 39, {"fx CRUSH", "fx PITCH", "fx COMB", "fx RING", "fx REVERB",
+	       "fx STUTTER", "fx GATE", "fx FILTER"}},
+   {"cc", 48, {"fx CUTTER", "fx REVERSE", "fx DUB", "fx TEMPO DELAY",
+	       "fx TALKBOX", "fx VIBROFLANGE", "fx DIRTY", "fx COMPRESSOR"}},
+   {"ccbutton", 57, {"mixer solo 0", "mixer solo 1", "mixer solo 2",
+		     "mixer solo 3"}},
+   {"ccbutton", 64, "fxHold", 1},
+   {"ccbutton", 65, {"mixer mute 0", "mixer mute 1", "mixer mute 2",
+		     "mixer mute 3", "mixer mute -1"}},
+}
+
+-- Compile the grid layout. Returns a table which maps each bank setting of
+-- launchpad mode to a table of all pad numbers n of both launchpad and drum
+-- mode, giving {note, bank, kind} for each pad, where bank is the bank of the
+-- given kind, to be added to the base channel. Also returns a table listing
+-- the pads of each mode in the order in which they are to be painted.
+function layout.compile()
+   -- number of bank settings in launchpad mode
+   local nbanks = layout.banks
+   for _, r in ipairs(layout.grid[0]) do
+      if r[3] == "pads" then
+	 nbanks = math.min(nbanks, layout.banks - r[4])
+      end
+   end
+   local tables, pads = {}, {}
+   for mode, grid in pairs(layout.grid) do
+      local p = {}
+      for _, r in ipairs(grid) do
+	 local row, col, kind, bank = table.unpack(r)
+	 local k = layout.kinds[kind]
+	 for i = 0, k.rows-1 do
+	    for j = 0, k.cols-1 do
+	       local n = grid.offset + (row+i)*8 + col+j
+	       local note = k.note + i*k.cols + j
+	       table.insert(p, n)
+	       for b = 0, nbanks-1 do
+		  local t = tables[b] or {}
+		  tables[b] = t
+		  if mode == 0 and kind == "pads" then
+		     t[n] = {note, bank+b, kind}
+		  else
+		     t[n] = {note, bank, kind}
+		  end
+	       end
+	    end
+	 end
+      end
+      table.sort(p)
+      pads[mode] = p
+   end
+   return tables, pads
+end
+
+-- Minimal JSON encoder, producing the same format as Koala.
+local function encode(x, indent)
+   indent = indent or ""
+   local ind = indent .. "\t"
+   if type(x) == "table" then
+      local items = {}
+      if #x > 0 then
+	 for i, v in ipairs(x) do
+	    items[i] = ind .. encode(v, ind)
+	 end
+	 return "[\n" .. table.concat(items, ",\n") .. "\n" .. indent .. "]"
+      else
+	 local keys = {}
+	 for k in pairs(x) do
+	    table.insert(keys, k)
+	 end
+	 table.sort(keys)
+	 for i, k in ipairs(keys) do
+	    items[i] = string.format('%s"%s": %s', ind, k, encode(x[k], ind))
+	 end
+	 return "{\n" .. table.concat(items, ",\n") .. "\n" .. indent .. "}"
+      end
+   elseif type(x) == "string" then
+      return '"' .. x .. '"'
+   else
+      return tostring(x)
+   end
+end
+
+-- Generate Koala's MIDI mapping for the given channels (layout.chan and
+-- layout.ctlchan by default), returns the JSON text.
+function layout.json(chan, ctlchan)
+   chan = chan or layout.chan
+   ctlchan = ctlchan or layout.ctlchan
+   local mapping = { mappings = {}, pads = {} }
+   -- Koala pads and sequence launchers, ordered by note and bank
+   for _, kind in ipairs{"seqs", "pads"} do
+      local k = layout.kinds[kind]
+      local size = k.rows*k.cols
+      for i = 0, size-1 do
+	 for b = 0, layout.banks-1 do
+	    -- Koala's index of the pad
+	    local index = b*size + (k.rows-1-i//k.cols)*k.cols + i%k.cols
+	    if kind == "pads" then
+	       table.insert(mapping.pads, { channel = chan+b, note = k.note+i,
+					    pad = index })
+	    else
+	       table.insert(mapping.mappings,
+			    { channel = chan+b, identifier = "seq " .. index,
+			      isButton = true, isCC = false,
+			      value = k.note+i })
+	    end
+	 end
+      end
+   end
+   for _, c in ipairs(layout.controls) do
+      local ctype, num, name, ch = table.unpack(c)
+      table.insert(mapping.mappings,
+		   { channel = ch or ctlchan, identifier = name,
+		     isButton = ctype ~= "cc", isCC = ctype ~= "note",
+		     value = num })
+   end
+   return encode(mapping) .. "\n"
+end
+
+return layout
@@ -0,0 +1,1272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#ifndef DEBUG
+// Set this to a nonzero value to enable debugging output.
+#define DEBUG 0
+#endif
+
+// RTP-MIDI (RFC 6295) session endpoint, using Apple's session protocol
+// (a.k.a. AppleMIDI), so that Pd can talk to iOS and macOS network MIDI
+// sessions, rtpmidid, rtpMIDI and MIDI Hub directly. A session listens on a
+// pair of UDP ports (control port and data port = control port + 1), accepts
+// invitations from other endpoints, and invites endpoints itself. Clock
+// synchronization measures the link latency of each peer, and outgoing
+// packets carry a recovery journal (chapters P, C, W, N and T), which lets
+// the receiver recover from lost packets. Incoming journals are used in the
+// same way. MIDI data is exchanged as raw bytes, which are translated to and
+// from SMMF with the midicodec module. Everything is nonblocking; the
+// session is driven by calling poll() regularly, or whenever one of its
+// sockets becomes readable.
+
+#define SESSION "rtpmidi.session"
+
+// Maximum number of peers, and maximum length of session names.
+#define MAX_PEERS 8
+#define NAME_LEN 64
+
+// Maximum size of a received datagram, and of outgoing MIDI lists and
+// journals (so that packets fit into an Ethernet frame).
+#define DGRAM_MAX 65536
+#define LIST_MAX 1024
+#define JOURNAL_MAX 1024
+
+// Maximum size of a reassembled sysex message.
+#define SYSEX_MAX 1024
+
+// Time is counted in ticks of 100 usec, the clock rate of the protocol.
+#define TICKS 10000
+
+// Invitations are retried every second, up to 12 times. Clock sync is done
+// every second for the first 6 times, then every 10 seconds. Peers which
+// haven't been heard of for a minute are dropped. Receiver feedback is sent
+// at most every second.
+#define INVITE_INTERVAL TICKS
+#define INVITE_TRIES 12
+#define SYNC_FAST TICKS
+#define SYNC_FAST_COUNT 6
+#define SYNC_SLOW (10*TICKS)
+#define PEER_TIMEOUT (60*TICKS)
+#define FEEDBACK_INTERVAL TICKS
+
+enum { P_FREE, P_INVITE_CTL, P_INVITE_DATA, P_ACCEPTED, P_CONNECTED };
+
+// MIDI state of a channel as seen by the receiver (-1 = unknown).
+typedef struct {
+  uint8_t vel[128];
+  int16_t cc[128];
+  int16_t prog, bend, touch;
+} recv_chan_t;
+
+// MIDI state of a channel as sent, along with the extended sequence number
+// of the packet which last changed each item (0 = never).
+typedef struct {
+  uint8_t vel[128], cc[128];
+  uint32_t note_seq[128], cc_seq[128];
+  uint8_t prog, bend_lsb, bend_msb, touch;
+  uint32_t prog_seq, bend_seq, touch_seq;
+} send_chan_t;
+
+typedef struct {
+  int state, initiator;
+  char name[NAME_LEN];
+  struct sockaddr_in ctl, data;
+  uint32_t token, ssrc;
+  int tries, syncs;
+  uint64_t next, seen;
+  double latency;
+  // incoming stream
+  int have_seq, feedback;
+  uint16_t seq;
+  uint64_t feedback_next;
+  int sysexlen;
+  uint8_t sysex[SYSEX_MAX];
+  recv_chan_t chan[16];
+  // outgoing stream: first packet not acknowledged yet
+  uint32_t ack;
+} peer_t;
+
+typedef struct {
+  int ctl, data;
+  int port;
+  char name[NAME_LEN];
+  uint32_t ssrc;
+  struct timespec t0;
+  // extended sequence number of the next packet, and the checkpoint
+  uint32_t seq, checkpoint;
+  send_chan_t chan[16];
+  peer_t peers[MAX_PEERS];
+  // state of the session's own random number generator, so that we don't
+  // mess with the global rand() sequence of the host
+  uint32_t rng;
+  // number of outgoing data packets still to be dropped (see drop())
+  int drop;
+  // MIDI received during the current poll
+  uint8_t *out;
+  size_t outlen, outsize;
+} session_t;
+
+/* Helper functions. *******************************************************/
+
+static int pusherror(lua_State *L, const char *msg)
+{
+  lua_pushnil(L);
+  lua_pushstring(L, msg);
+  return 2;
+}
+
+static session_t *checksession(lua_State *L, int i)
+{
+  session_t *s = (session_t*)luaL_checkudata(L, i, SESSION);
+  if (s->ctl < 0) luaL_error(L, "rtpmidi: session has been closed");
+  return s;
+}
+
+static uint64_t now(session_t *s)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)(ts.tv_sec - s->t0.tv_sec)*TICKS +
+    (ts.tv_nsec - s->t0.tv_nsec)/(1000000000/TICKS);
+}
+
+static void put16(uint8_t *p, uint16_t x)
+{
+  p[0] = x >> 8; p[1] = x;
+}
+
+static void put32(uint8_t *p, uint32_t x)
+{
+  put16(p, x >> 16); put16(p+2, x);
+}
+
+static void put64(uint8_t *p, uint64_t x)
+{
+  put32(p, x >> 32); put32(p+4, x);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+  return ((uint32_t)get16(p) << 16) | get16(p+2);
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+  return ((uint64_t)get32(p) << 32) | get32(p+4);
+}
+
+// xorshift32, the state must be nonzero
+static uint32_t random32(session_t *s)
+{
+  uint32_t x = s->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return s->rng = x;
+}
+
+// seed the generator from /dev/urandom, or from the clock if that fails
+static void seed(session_t *s)
+{
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd < 0 || read(fd, &s->rng, sizeof(s->rng)) != sizeof(s->rng))
+    s->rng = s->t0.tv_sec ^ s->t0.tv_nsec ^ getpid() ^ s->port;
+  if (fd >= 0) close(fd);
+  if (!s->rng) s->rng = 0x9e3779b9;
+}
+
+// number of data bytes following a channel or system common status byte
+static int datalen(uint8_t status)
+{
+  switch (status & 0xf0) {
+  case 0xc0: case 0xd0: return 1;
+  case 0xf0:
+    switch (status) {
+    case 0xf1: case 0xf3: return 1;
+    case 0xf2: return 2;
+    default: return 0;
+    }
+  default: return 2;
+  }
+}
+
+static const char *addrstr(struct sockaddr_in *addr, char *buf)
+{
+  return inet_ntop(AF_INET, &addr->sin_addr, buf, INET_ADDRSTRLEN);
+}
+
+/* Peers. ******************************************************************/
+
+static peer_t *new_peer(session_t *s)
+{
+  int i, k;
+  for (i = 0; i < MAX_PEERS; i++) {
+    peer_t *p = &s->peers[i];
+    if (p->state == P_FREE) {
+      memset(p, 0, sizeof(peer_t));
+      p->latency = -1;
+      p->sysexlen = -1;
+      for (k = 0; k < 16; k++) {
+	memset(p->chan[k].cc, 0xff, sizeof(p->chan[k].cc));
+	p->chan[k].prog = p->chan[k].bend = p->chan[k].touch = -1;
+      }
+      return p;
+    }
+  }
+  return NULL;
+}
+
+static peer_t *find_peer(session_t *s, uint32_t ssrc)
+{
+  int i;
+  for (i = 0; i < MAX_PEERS; i++) {
+    peer_t *p = &s->peers[i];
+    if (p->state >= P_ACCEPTED && p->ssrc == ssrc)
+      return p;
+  }
+  return NULL;
+}
+
+static peer_t *find_invite(session_t *s, uint32_t token, int state)
+{
+  int i;
+  for (i = 0; i < MAX_PEERS; i++) {
+    peer_t *p = &s->peers[i];
+    if (p->state == state && p->token == token)
+      return p;
+  }
+  return NULL;
+}
+
+// The journal must cover everything that some peer hasn't acknowledged
+// yet. Peers which never send feedback thus keep the journal at full size,
+// which is bounded by the MIDI state, though.
+static void update_checkpoint(session_t *s)
+{
+  uint32_t cp = s->seq;
+  int i;
+  for (i = 0; i < MAX_PEERS; i++) {
+    peer_t *p = &s->peers[i];
+    if (p->state == P_CONNECTED && p->ack < cp)
+      cp = p->ack;
+  }
+  s->checkpoint = cp;
+}
+
+// Push an event {type, name, ...} onto the table at the top of the stack.
+static void event(lua_State *L, int *n, const char *type, peer_t *p)
+{
+  char buf[INET_ADDRSTRLEN];
+  lua_createtable(L, 4, 0);
+  lua_pushstring(L, type);
+  lua_rawseti(L, -2, 1);
+  lua_pushstring(L, p->name[0] ? p->name : addrstr(&p->ctl, buf));
+  lua_rawseti(L, -2, 2);
+  if (!strcmp(type, "connected")) {
+    lua_pushstring(L, addrstr(&p->ctl, buf));
+    lua_rawseti(L, -2, 3);
+    lua_pushinteger(L, ntohs(p->ctl.sin_port));
+    lua_rawseti(L, -2, 4);
+  } else if (!strcmp(type, "latency")) {
+    lua_pushnumber(L, p->latency);
+    lua_rawseti(L, -2, 3);
+  }
+  lua_rawseti(L, -2, ++*n);
+}
+
+/* Session protocol. *******************************************************/
+
+// IN, OK, NO and BY
+static void send_cmd(session_t *s, int fd, struct sockaddr_in *to,
+		     const char *cmd, uint32_t token)
+{
+  uint8_t buf[16+NAME_LEN];
+  size_t n = 16;
+  buf[0] = buf[1] = 0xff;
+  buf[2] = cmd[0]; buf[3] = cmd[1];
+  put32(buf+4, 2); // protocol version
+  put32(buf+8, token);
+  put32(buf+12, s->ssrc);
+  if (strcmp(cmd, "BY")) {
+    strcpy((char*)buf+16, s->name);
+    n += strlen(s->name)+1;
+  }
+  sendto(fd, buf, n, 0, (struct sockaddr*)to, sizeof(*to));
+}
+
+// CK: clock synchronization, count = 0, 1, 2
+static void send_sync(session_t *s, peer_t *p, int count,
+		      uint64_t ts1, uint64_t ts2, uint64_t ts3)
+{
+  uint8_t buf[36];
+  memset(buf, 0, sizeof(buf));
+  buf[0] = buf[1] = 0xff;
+  buf[2] = 'C'; buf[3] = 'K';
+  put32(buf+4, s->ssrc);
+  buf[8] = count;
+  put64(buf+12, ts1);
+  put64(buf+20, ts2);
+  put64(buf+28, ts3);
+  sendto(s->data, buf, sizeof(buf), 0, (struct sockaddr*)&p->data,
+	 sizeof(p->data));
+}
+
+// RS: receiver feedback, the last sequence number received
+static void send_feedback(session_t *s, peer_t *p)
+{
+  uint8_t buf[12];
+  buf[0] = buf[1] = 0xff;
+  buf[2] = 'R'; buf[3] = 'S';
+  put32(buf+4, s->ssrc);
+  put16(buf+8, p->seq);
+  buf[10] = buf[11] = 0;
+  sendto(s->ctl, buf, sizeof(buf), 0, (struct sockaddr*)&p->ctl,
+	 sizeof(p->ctl));
+}
+
+static void handle_cmd(lua_State *L, int *n, session_t *s, int isdata,
+		       const uint8_t *buf, size_t len, struct sockaddr_in *from)
+{
+  int fd = isdata ? s->data : s->ctl;
+  uint64_t t = now(s);
+  peer_t *p;
+  if (len >= 16 && (!memcmp(buf+2, "IN", 2) || !memcmp(buf+2, "OK", 2) ||
+		    !memcmp(buf+2, "NO", 2))) {
+    uint32_t token = get32(buf+8), ssrc = get32(buf+12);
+    char name[NAME_LEN] = "";
+    if (len > 16) {
+      size_t k = len-16 < NAME_LEN-1 ? len-16 : NAME_LEN-1;
+      memcpy(name, buf+16, k);
+      name[k] = 0;
+    }
+    if (!memcmp(buf+2, "IN", 2)) {
+      if (!isdata) {
+	// invitation on the control port: accept, unless we're full
+	if (!(p = find_peer(s, ssrc)) && !(p = new_peer(s))) {
+	  send_cmd(s, fd, from, "NO", token);
+	  return;
+	}
+	if (p->state == P_CONNECTED)
+	  // the peer restarted the session, forget its old stream
+	  event(L, n, "disconnected", p);
+	if (p->state != P_ACCEPTED) {
+	  p->state = P_FREE;
+	  p = new_peer(s);
+	}
+	p->state = P_ACCEPTED;
+	p->ctl = p->data = *from;
+	p->data.sin_port = htons(ntohs(from->sin_port)+1);
+	p->token = token;
+	p->ssrc = ssrc;
+	p->seen = t;
+	strcpy(p->name, name);
+	send_cmd(s, fd, from, "OK", token);
+      } else if ((p = find_peer(s, ssrc))) {
+	// invitation on the data port: the session is up
+	p->data = *from;
+	send_cmd(s, fd, from, "OK", token);
+	if (p->state == P_ACCEPTED) {
+	  p->state = P_CONNECTED;
+	  p->seen = t;
+	  p->ack = s->seq;
+	  event(L, n, "connected", p);
+	}
+      } else {
+	send_cmd(s, fd, from, "NO", token);
+      }
+    } else if (!memcmp(buf+2, "OK", 2)) {
+      if (!isdata && (p = find_invite(s, token, P_INVITE_CTL))) {
+	p->ssrc = ssrc;
+	strcpy(p->name, name);
+	p->state = P_INVITE_DATA;
+	p->tries = 0;
+	p->next = t;
+      } else if (isdata && (p = find_invite(s, token, P_INVITE_DATA))) {
+	p->state = P_CONNECTED;
+	p->seen = t;
+	p->next = t;
+	p->ack = s->seq;
+	event(L, n, "connected", p);
+      }
+    } else if ((p = find_invite(s, token, isdata ? P_INVITE_DATA :
+				P_INVITE_CTL))) {
+      // invitation rejected
+      if (name[0]) strcpy(p->name, name);
+      p->state = P_FREE;
+      event(L, n, "disconnected", p);
+    }
+  } else if (len >= 16 && !memcmp(buf+2, "BY", 2)) {
+    if ((p = find_peer(s, get32(buf+12)))) {
+      if (p->state == P_CONNECTED)
+	event(L, n, "disconnected", p);
+      p->state = P_FREE;
+      update_checkpoint(s);
+    }
+  } else if (len >= 36 && !memcmp(buf+2, "CK", 2)) {
+    uint64_t ts1 = get64(buf+12), ts2 = get64(buf+20);
+    if (!(p = find_peer(s, get32(buf+4))) || p->state != P_CONNECTED)
+      return;
+    p->seen = t;
+    switch (buf[8]) {
+    case 0:
+      send_sync(s, p, 1, ts1, t, 0);
+      break;
+    case 1:
+      // our sync request came back, the latency is half the round trip
+      send_sync(s, p, 2, ts1, ts2, t);
+      p->latency = (t - ts1)/2.0/(TICKS/1000);
+      event(L, n, "latency", p);
+      break;
+    case 2:
+      p->latency = (t - ts2)/2.0/(TICKS/1000);
+      event(L, n, "latency", p);
+      break;
+    }
+  } else if (len >= 12 && !memcmp(buf+2, "RS", 2)) {
+    if ((p = find_peer(s, get32(buf+4))) && p->state == P_CONNECTED) {
+      // map the 16 bit sequence number to the extended one
+      uint32_t seq = s->seq - 1 - (uint16_t)(s->seq - 1 - get16(buf+8));
+      if (seq+1 > p->ack && seq < s->seq) {
+	p->ack = seq+1;
+	update_checkpoint(s);
+      }
+    }
+  }
+}
+
+/* Receiving MIDI. *********************************************************/
+
+static void output(session_t *s, const uint8_t *msg, size_t len)
+{
+  if (s->outlen + len > s->outsize) {
+    size_t size = 2*(s->outlen + len);
+    uint8_t *out = realloc(s->out, size);
+    if (!out) return;
+    s->out = out;
+    s->outsize = size;
+  }
+  memcpy(s->out + s->outlen, msg, len);
+  s->outlen += len;
+}
+
+// output a MIDI message, keeping track of the channel state
+static void emit(session_t *s, peer_t *p, const uint8_t *msg, size_t len)
+{
+  if (len == 3 || len == 2) {
+    recv_chan_t *c = &p->chan[msg[0] & 0x0f];
+    switch (msg[0] & 0xf0) {
+    case 0x80: c->vel[msg[1]] = 0; break;
+    case 0x90: c->vel[msg[1]] = msg[2]; break;
+    case 0xb0: c->cc[msg[1]] = msg[2]; break;
+    case 0xc0: c->prog = msg[1]; break;
+    case 0xd0: c->touch = msg[1]; break;
+    case 0xe0: c->bend = msg[1] | (msg[2] << 7); break;
+    }
+  }
+  output(s, msg, len);
+}
+
+static void emit3(session_t *s, peer_t *p, uint8_t a, uint8_t b, uint8_t c)
+{
+  uint8_t msg[3] = { a, b, c };
+  emit(s, p, msg, datalen(a)+1);
+}
+
+// Sysex segments: F0 ... F7 is a complete message, F0 ... F0 the first, F7
+// ... F0 a middle and F7 ... F7 the last segment of a longer message.
+static void sysex(session_t *s, peer_t *p, const uint8_t *seg, size_t len)
+{
+  int first = seg[0] == 0xf0, last = seg[len-1] == 0xf7;
+  if (first && last) {
+    emit(s, p, seg, len);
+    return;
+  }
+  if (first) {
+    p->sysexlen = 0;
+  } else if (p->sysexlen < 0) {
+    return; // we missed the start
+  } else {
+    seg++; len--;
+  }
+  if (!last) len--;
+  if (p->sysexlen + len > SYSEX_MAX) {
+    p->sysexlen = -1;
+    return;
+  }
+  memcpy(p->sysex + p->sysexlen, seg, len);
+  p->sysexlen += len;
+  if (last) {
+    emit(s, p, p->sysex, p->sysexlen);
+    p->sysexlen = -1;
+  }
+}
+
+static void parse_list(session_t *s, peer_t *p, const uint8_t *list,
+		       size_t len, int z)
+{
+  size_t pos = 0;
+  uint8_t status = 0;
+  int first = 1;
+  while (pos < len) {
+    int k;
+    if (!first || z) {
+      // skip the delta time
+      for (k = 0; k < 3 && pos < len && (list[pos] & 0x80); k++) pos++;
+      pos++;
+    }
+    first = 0;
+    if (pos >= len) break;
+    if (list[pos] == 0xf0 || list[pos] == 0xf7) {
+      size_t end = pos+1;
+      while (end < len && list[end] != 0xf0 && list[end] != 0xf7) end++;
+      if (end >= len) break;
+      sysex(s, p, list+pos, end-pos+1);
+      status = 0;
+      pos = end+1;
+      continue;
+    } else if (list[pos] >= 0xf8) {
+      // system realtime
+      output(s, list+pos, 1);
+      pos++;
+      continue;
+    } else if (list[pos] >= 0xf0) {
+      // system common, cancels running status
+      k = datalen(list[pos]);
+      if (pos+k >= len) break;
+      output(s, list+pos, k+1);
+      status = 0;
+      pos += k+1;
+      continue;
+    } else if (list[pos] & 0x80) {
+      status = list[pos++];
+    } else if (!status) {
+      break;
+    }
+    k = datalen(status);
+    if (pos+k > len) break;
+    {
+      uint8_t msg[3] = { status, list[pos], k > 1 ? list[pos+1] : 0 };
+      emit(s, p, msg, k+1);
+    }
+    pos += k;
+  }
+}
+
+// Recover the state of a channel from its journal, after packet loss.
+static void recover_chan(session_t *s, peer_t *p, int ch, const uint8_t *c,
+			 size_t len, uint8_t toc)
+{
+  recv_chan_t *st = &p->chan[ch];
+  size_t pos = 0;
+  int i, k;
+  if (toc & 0x80) {
+    // chapter P: program change
+    if (pos+3 > len) return;
+    if (st->prog != (c[pos] & 0x7f)) {
+      if (c[pos+1] & 0x80) {
+	emit3(s, p, 0xb0|ch, 0, c[pos+1] & 0x7f);
+	emit3(s, p, 0xb0|ch, 32, c[pos+2] & 0x7f);
+      }
+      emit3(s, p, 0xc0|ch, c[pos] & 0x7f, 0);
+    }
+    pos += 3;
+  }
+  if (toc & 0x40) {
+    // chapter C: control change
+    if (pos+1 > len) return;
+    k = (c[pos++] & 0x7f) + 1;
+    if (pos+2*k > len) return;
+    for (i = 0; i < k; i++, pos += 2) {
+      int num = c[pos] & 0x7f, val = c[pos+1] & 0x7f;
+      // values with the A bit set use the alternative (toggle/count)
+      // encodings, which we don't handle
+      if (!(c[pos+1] & 0x80) && st->cc[num] != val)
+	emit3(s, p, 0xb0|ch, num, val);
+    }
+  }
+  if (toc & 0x20) {
+    // chapter M: parameters (skipped)
+    if (pos+2 > len) return;
+    pos += ((c[pos] & 0x03) << 8) | c[pos+1];
+  }
+  if (toc & 0x10) {
+    // chapter W: pitch bend
+    if (pos+2 > len) return;
+    if (st->bend != ((c[pos] & 0x7f) | ((c[pos+1] & 0x7f) << 7)))
+      emit3(s, p, 0xe0|ch, c[pos] & 0x7f, c[pos+1] & 0x7f);
+    pos += 2;
+  }
+  if (toc & 0x08) {
+    // chapter N: note on/off
+    int low, high;
+    if (pos+2 > len) return;
+    k = c[pos] & 0x7f;
+    low = c[pos+1] >> 4;
+    high = c[pos+1] & 0x0f;
+    if (k == 127 && low == 15 && high == 0) k = 128;
+    pos += 2;
+    if (pos+2*k > len) return;
+    for (i = 0; i < k; i++, pos += 2) {
+      int num = c[pos] & 0x7f, vel = c[pos+1] & 0x7f;
+      // the Y bit tells whether the note should still be played
+      if ((c[pos+1] & 0x80) && vel && !st->vel[num])
+	emit3(s, p, 0x90|ch, num, vel);
+    }
+    for (i = low; i <= high; i++, pos++) {
+      if (pos >= len) return;
+      for (k = 0; k < 8; k++)
+	if ((c[pos] & (0x80 >> k)) && st->vel[8*i+k])
+	  emit3(s, p, 0x80|ch, 8*i+k, 0);
+    }
+  }
+  if (toc & 0x04) {
+    // chapter E: note extras (skipped)
+    if (pos+1 > len) return;
+    pos += 1 + 2*((c[pos] & 0x7f) + 1);
+  }
+  if (toc & 0x02) {
+    // chapter T: channel pressure
+    if (pos+1 > len) return;
+    if (st->touch != (c[pos] & 0x7f))
+      emit3(s, p, 0xd0|ch, c[pos] & 0x7f, 0);
+  }
+}
+
+static void recover(session_t *s, peer_t *p, const uint8_t *j, size_t len)
+{
+  size_t pos = 3;
+  int nchans, i;
+  if (len < 3) return;
+  nchans = (j[0] & 0x0f) + 1;
+  if (j[0] & 0x40) {
+    // system journal (skipped)
+    if (pos+2 > len) return;
+    pos += ((j[pos] & 0x03) << 8) | j[pos+1];
+  }
+  if (!(j[0] & 0x20)) return;
+  for (i = 0; i < nchans && pos+3 <= len; i++) {
+    size_t clen = ((j[pos] & 0x03) << 8) | j[pos+1];
+    if (clen < 3 || pos+clen > len) return;
+    recover_chan(s, p, (j[pos] >> 3) & 0x0f, j+pos+3, clen-3, j[pos+2]);
+    pos += clen;
+  }
+}
+
+static void handle_rtp(lua_State *L, int *n, session_t *s,
+		       const uint8_t *buf, size_t len)
+{
+  peer_t *p = find_peer(s, get32(buf+8));
+  uint16_t seq = get16(buf+2);
+  size_t pos = 12 + 4*(buf[0] & 0x0f), cmdlen;
+  int lost, flags;
+  if (!p || p->state != P_CONNECTED) return;
+  if (buf[0] & 0x20) {
+    // padding
+    if (buf[len-1] > len) return;
+    len -= buf[len-1];
+  }
+  if (buf[0] & 0x10) {
+    // header extension
+    if (pos+4 > len) return;
+    pos += 4 + 4*get16(buf+pos+2);
+  }
+  if (pos >= len) return;
+  if (p->have_seq && (int16_t)(seq - p->seq) <= 0)
+    return; // duplicate or out of order
+  lost = p->have_seq && seq != (uint16_t)(p->seq+1);
+  p->seq = seq;
+  p->have_seq = p->feedback = 1;
+  p->seen = now(s);
+  flags = buf[pos];
+  cmdlen = flags & 0x0f;
+  if (flags & 0x80) {
+    if (++pos >= len) return;
+    cmdlen = (cmdlen << 8) | buf[pos];
+  }
+  pos++;
+  if (pos+cmdlen > len) return;
+  s->outlen = 0;
+  if (lost && (flags & 0x40)) {
+#if DEBUG
+    fprintf(stderr, "rtpmidi: packet loss before %u, recovering\n", seq);
+#endif
+    recover(s, p, buf+pos+cmdlen, len-pos-cmdlen);
+  }
+  parse_list(s, p, buf+pos, cmdlen, flags & 0x20);
+  if (s->outlen > 0) {
+    lua_createtable(L, 3, 0);
+    lua_pushstring(L, "midi");
+    lua_rawseti(L, -2, 1);
+    lua_pushstring(L, p->name);
+    lua_rawseti(L, -2, 2);
+    lua_pushlstring(L, (char*)s->out, s->outlen);
+    lua_rawseti(L, -2, 3);
+    lua_rawseti(L, -2, ++*n);
+  }
+}
+
+static void receive(lua_State *L, int *n, session_t *s, int isdata)
+{
+  static uint8_t buf[DGRAM_MAX];
+  struct sockaddr_in from;
+  socklen_t fromlen = sizeof(from);
+  ssize_t len;
+  while ((len = recvfrom(isdata ? s->data : s->ctl, buf, sizeof(buf), 0,
+			 (struct sockaddr*)&from, &fromlen)) >= 0) {
+    if (len >= 4 && buf[0] == 0xff && buf[1] == 0xff)
+      handle_cmd(L, n, s, isdata, buf, len, &from);
+    else if (isdata && len >= 13 && (buf[0] & 0xc0) == 0x80)
+      handle_rtp(L, n, s, buf, len);
+    fromlen = sizeof(from);
+  }
+}
+
+/* Sending MIDI. ***********************************************************/
+
+// Encode the journal of the channels changed since the checkpoint. Returns
+// the size of the journal, 0 if there's nothing to encode or if it's too big.
+static size_t journal(session_t *s, uint8_t *j)
+{
+  size_t pos = 3;
+  int nchans = 0, ch, i;
+  uint32_t cp = s->checkpoint;
+  for (ch = 0; ch < 16; ch++) {
+    send_chan_t *c = &s->chan[ch];
+    uint8_t buf[600], toc = 0;
+    size_t k = 0, len;
+    int nlogs = 0, low = 16, high = -1;
+    if (c->prog_seq >= cp && c->prog_seq) {
+      // chapter P, with the bank if it was set
+      toc |= 0x80;
+      buf[k++] = c->prog;
+      if (c->cc_seq[0] || c->cc_seq[32]) {
+	buf[k++] = 0x80 | c->cc[0];
+	buf[k++] = c->cc[32];
+      } else {
+	buf[k++] = 0;
+	buf[k++] = 0;
+      }
+    }
+    for (i = 0; i < 128; i++)
+      if (c->cc_seq[i] >= cp && c->cc_seq[i]) nlogs++;
+    if (nlogs) {
+      // chapter C
+      toc |= 0x40;
+      buf[k++] = nlogs-1;
+      for (i = 0; i < 128; i++)
+	if (c->cc_seq[i] >= cp && c->cc_seq[i]) {
+	  buf[k++] = i;
+	  buf[k++] = c->cc[i];
+	}
+    }
+    if (c->bend_seq >= cp && c->bend_seq) {
+      // chapter W
+      toc |= 0x10;
+      buf[k++] = c->bend_lsb;
+      buf[k++] = c->bend_msb;
+    }
+    nlogs = 0;
+    for (i = 0; i < 128; i++)
+      if (c->note_seq[i] >= cp && c->note_seq[i]) {
+	if (c->vel[i]) {
+	  nlogs++;
+	} else {
+	  if (i/8 < low) low = i/8;
+	  high = i/8;
+	}
+      }
+    if (nlogs || high >= 0) {
+      // chapter N: note logs for the notes which are on, and a bitmap of
+      // the notes which were switched off
+      toc |= 0x08;
+      if (high < 0) {
+	// no offbits; 127 logs with LOW = 15, HIGH = 0 would mean 128
+	if (nlogs == 127) {
+	  low = high = 0;
+	} else {
+	  low = 15;
+	  high = 0;
+	}
+      }
+      buf[k++] = nlogs == 128 ? 127 : nlogs;
+      buf[k++] = (low << 4) | high;
+      for (i = 0; i < 128; i++)
+	if (c->note_seq[i] >= cp && c->note_seq[i] && c->vel[i]) {
+	  buf[k++] = i;
+	  buf[k++] = 0x80 | c->vel[i];
+	}
+      for (i = low; i <= high; i++) {
+	int b;
+	buf[k] = 0;
+	for (b = 0; b < 8; b++)
+	  if (c->note_seq[8*i+b] >= cp && c->note_seq[8*i+b] &&
+	      !c->vel[8*i+b])
+	    buf[k] |= 0x80 >> b;
+	k++;
+      }
+    }
+    if (c->touch_seq >= cp && c->touch_seq) {
+      // chapter T
+      toc |= 0x02;
+      buf[k++] = c->touch;
+    }
+    if (!toc) continue;
+    len = k+3;
+    if (pos+len > JOURNAL_MAX) return 0;
+    j[pos] = (ch << 3) | (len >> 8);
+    j[pos+1] = len;
+    j[pos+2] = toc;
+    memcpy(j+pos+3, buf, k);
+    pos += len;
+    nchans++;
+  }
+  if (!nchans) return 0;
+  j[0] = 0x20 | (nchans-1);
+  put16(j+1, cp);
+  return pos;
+}
+
+// record a MIDI message sent in the current packet
+static void record(session_t *s, const uint8_t *msg, size_t len)
+{
+  send_chan_t *c = &s->chan[msg[0] & 0x0f];
+  uint32_t seq = s->seq;
+  if (len < 2) return;
+  switch (msg[0] & 0xf0) {
+  case 0x80:
+    c->vel[msg[1]] = 0;
+    c->note_seq[msg[1]] = seq;
+    break;
+  case 0x90:
+    c->vel[msg[1]] = msg[2];
+    c->note_seq[msg[1]] = seq;
+    break;
+  case 0xb0:
+    c->cc[msg[1]] = msg[2];
+    c->cc_seq[msg[1]] = seq;
+    break;
+  case 0xc0:
+    c->prog = msg[1];
+    c->prog_seq = seq;
+    break;
+  case 0xd0:
+    c->touch = msg[1];
+    c->touch_seq = seq;
+    break;
+  case 0xe0:
+    c->bend_lsb = msg[1];
+    c->bend_msb = msg[2];
+    c->bend_seq = seq;
+    break;
+  }
+}
+
+// Send a packet with the given MIDI data to all peers. Returns the number of
+// peers, or -1 if the data is malformed or too long.
+static int send_midi(session_t *s, const uint8_t *data, size_t len)
+{
+  uint8_t pkt[14+LIST_MAX+JOURNAL_MAX], list[LIST_MAX];
+  size_t pos = 0, k = 0, jlen, hdr;
+  int i, npeers = 0;
+  for (i = 0; i < MAX_PEERS; i++)
+    if (s->peers[i].state == P_CONNECTED) npeers++;
+  if (!npeers) return 0;
+  // the MIDI list, each command but the first with a zero delta time
+  while (pos < len) {
+    size_t n;
+    if (!(data[pos] & 0x80)) return -1;
+    if (data[pos] == 0xf0) {
+      for (n = 1; pos+n < len && data[pos+n] != 0xf7; n++) ;
+      if (pos+n >= len) return -1;
+      n++;
+    } else {
+      n = data[pos] >= 0xf8 ? 1 : datalen(data[pos])+1;
+      if (pos+n > len) return -1;
+    }
+    if (k+n+1 > LIST_MAX) return -1;
+    if (k > 0) list[k++] = 0;
+    memcpy(list+k, data+pos, n);
+    k += n;
+    pos += n;
+  }
+  if (!k) return 0;
+  // RTP header: version 2, payload type 97
+  pkt[0] = 0x80;
+  pkt[1] = 0x61;
+  put16(pkt+2, s->seq);
+  put32(pkt+4, now(s));
+  put32(pkt+8, s->ssrc);
+  // the journal covers the packets before this one
+  jlen = journal(s, pkt+14+k);
+  if (k > 15) {
+    pkt[12] = 0x80 | (jlen ? 0x40 : 0) | (k >> 8);
+    pkt[13] = k;
+    hdr = 14;
+  } else {
+    pkt[12] = (jlen ? 0x40 : 0) | k;
+    hdr = 13;
+  }
+  memcpy(pkt+hdr, list, k);
+  if (jlen && hdr == 13) memmove(pkt+hdr+k, pkt+14+k, jlen);
+  for (pos = 0; pos < k; ) {
+    size_t n;
+    if (pos > 0) pos++;
+    if (list[pos] == 0xf0)
+      n = (uint8_t*)memchr(list+pos, 0xf7, k-pos) - (list+pos) + 1;
+    else
+      n = list[pos] >= 0xf8 ? 1 : datalen(list[pos])+1;
+    record(s, list+pos, n);
+    pos += n;
+  }
+  for (i = 0; i < MAX_PEERS && s->drop <= 0; i++) {
+    peer_t *p = &s->peers[i];
+    if (p->state == P_CONNECTED)
+      sendto(s->data, pkt, hdr+k+jlen, 0, (struct sockaddr*)&p->data,
+	     sizeof(p->data));
+  }
+  if (s->drop > 0) s->drop--;
+  s->seq++;
+  return npeers;
+}
+
+/* Timers. *****************************************************************/
+
+static void timers(lua_State *L, int *n, session_t *s)
+{
+  uint64_t t = now(s);
+  int i;
+  for (i = 0; i < MAX_PEERS; i++) {
+    peer_t *p = &s->peers[i];
+    switch (p->state) {
+    case P_INVITE_CTL:
+    case P_INVITE_DATA:
+      if (t < p->next) break;
+      if (p->tries++ >= INVITE_TRIES) {
+	p->state = P_FREE;
+	event(L, n, "disconnected", p);
+	break;
+      }
+      if (p->state == P_INVITE_CTL)
+	send_cmd(s, s->ctl, &p->ctl, "IN", p->token);
+      else
+	send_cmd(s, s->data, &p->data, "IN", p->token);
+      p->next = t + INVITE_INTERVAL;
+      break;
+    case P_ACCEPTED:
+      // waiting for the invitation on the data port
+      if (t - p->seen > INVITE_TRIES*INVITE_INTERVAL)
+	p->state = P_FREE;
+      break;
+    case P_CONNECTED:
+      if (t - p->seen > PEER_TIMEOUT) {
+	send_cmd(s, s->ctl, &p->ctl, "BY", 0);
+	p->state = P_FREE;
+	event(L, n, "disconnected", p);
+	update_checkpoint(s);
+	break;
+      }
+      if (p->initiator && t >= p->next) {
+	send_sync(s, p, 0, t, 0, 0);
+	p->next = t + (++p->syncs < SYNC_FAST_COUNT ? SYNC_FAST : SYNC_SLOW);
+      }
+      if (p->feedback && t >= p->feedback_next) {
+	send_feedback(s, p);
+	p->feedback = 0;
+	p->feedback_next = t + FEEDBACK_INTERVAL;
+      }
+      break;
+    }
+  }
+}
+
+/* Lua API. ****************************************************************/
+
+static int bind_port(int fd, int port)
+{
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  return bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+// open(name, [port]): open a session with the given name on the given
+// control port (5004 by default, 0 = any free pair of ports). Returns the
+// session, or nil and an error message.
+static int l_open(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  int port = luaL_optinteger(L, 2, 5004), tries;
+  session_t *s = (session_t*)lua_newuserdata(L, sizeof(session_t));
+  memset(s, 0, sizeof(session_t));
+  s->ctl = s->data = -1;
+  luaL_setmetatable(L, SESSION);
+  // an ephemeral control port may be followed by a busy one, so we retry
+  for (tries = port ? 1 : 10; tries > 0; tries--) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if ((s->ctl = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+	(s->data = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+      break;
+    if (bind_port(s->ctl, port) == 0 &&
+	getsockname(s->ctl, (struct sockaddr*)&addr, &len) == 0 &&
+	bind_port(s->data, ntohs(addr.sin_port)+1) == 0) {
+      s->port = ntohs(addr.sin_port);
+      break;
+    }
+    close(s->ctl);
+    close(s->data);
+    s->ctl = s->data = -1;
+  }
+  if (s->ctl < 0 || s->data < 0) {
+    int err = errno;
+    if (s->ctl >= 0) close(s->ctl);
+    s->ctl = s->data = -1;
+    return pusherror(L, strerror(err));
+  }
+  fcntl(s->ctl, F_SETFL, fcntl(s->ctl, F_GETFL) | O_NONBLOCK);
+  fcntl(s->data, F_SETFL, fcntl(s->data, F_GETFL) | O_NONBLOCK);
+  strncpy(s->name, name, NAME_LEN-1);
+  clock_gettime(CLOCK_MONOTONIC, &s->t0);
+  seed(s);
+  s->ssrc = random32(s);
+  // extended sequence numbers start at a random 16 bit value, and are never
+  // 0, so that 0 can mean "never changed" in the journal state
+  s->seq = s->checkpoint = 0x10000 | (random32(s) & 0xffff);
+  return 1;
+}
+
+// session:close(): end all sessions with peers, and close the sockets.
+static int l_close(lua_State *L)
+{
+  session_t *s = (session_t*)luaL_checkudata(L, 1, SESSION);
+  int i;
+  if (s->ctl < 0) return 0;
+  for (i = 0; i < MAX_PEERS; i++) {
+    peer_t *p = &s->peers[i];
+    if (p->state >= P_ACCEPTED)
+      send_cmd(s, s->ctl, &p->ctl, "BY", 0);
+    p->state = P_FREE;
+  }
+  close(s->ctl);
+  close(s->data);
+  s->ctl = s->data = -1;
+  free(s->out);
+  s->out = NULL;
+  return 0;
+}
+
+// session:port(): the control port of the session.
+static int l_port(lua_State *L)
+{
+  session_t *s = checksession(L, 1);
+  lua_pushinteger(L, s->port);
+  return 1;
+}
+
+// session:fds(): the file descriptors to wait on.
+static int l_fds(lua_State *L)
+{
+  session_t *s = checksession(L, 1);
+  lua_createtable(L, 2, 0);
+  lua_pushinteger(L, s->ctl);
+  lua_rawseti(L, -2, 1);
+  lua_pushinteger(L, s->data);
+  lua_rawseti(L, -2, 2);
+  return 1;
+}
+
+// session:invite(host, port): invite the endpoint with the given control
+// port. The invitation is sent by poll(), which reports a connected event
+// once the session is up. Returns true, or nil and an error message.
+static int l_invite(lua_State *L)
+{
+  session_t *s = checksession(L, 1);
+  const char *host = luaL_checkstring(L, 2);
+  const char *port = luaL_checkstring(L, 3);
+  struct addrinfo hints, *res;
+  peer_t *p;
+  int err, i;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if ((err = getaddrinfo(host, port, &hints, &res)) != 0)
+    return pusherror(L, gai_strerror(err));
+  for (i = 0; i < MAX_PEERS; i++) {
+    // already connected or being invited?
+    p = &s->peers[i];
+    if (p->state != P_FREE && !memcmp(&p->ctl.sin_addr,
+	 &((struct sockaddr_in*)res->ai_addr)->sin_addr, sizeof(struct in_addr))
+	&& p->ctl.sin_port == ((struct sockaddr_in*)res->ai_addr)->sin_port) {
+      freeaddrinfo(res);
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+  }
+  if (!(p = new_peer(s))) {
+    freeaddrinfo(res);
+    return pusherror(L, "too many peers");
+  }
+  memcpy(&p->ctl, res->ai_addr, sizeof(p->ctl));
+  freeaddrinfo(res);
+  p->data = p->ctl;
+  p->data.sin_port = htons(ntohs(p->ctl.sin_port)+1);
+  p->state = P_INVITE_CTL;
+  p->initiator = 1;
+  p->token = random32(s);
+  p->next = now(s);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// session:bye([name]): end the session with the given peer, or all peers.
+static int l_bye(lua_State *L)
+{
+  session_t *s = checksession(L, 1);
+  const char *name = luaL_optstring(L, 2, NULL);
+  int i;
+  for (i = 0; i < MAX_PEERS; i++) {
+    peer_t *p = &s->peers[i];
+    if (p->state != P_FREE && (!name || !strcmp(name, p->name))) {
+      if (p->state >= P_ACCEPTED)
+	send_cmd(s, s->ctl, &p->ctl, "BY", 0);
+      p->state = P_FREE;
+    }
+  }
+  update_checkpoint(s);
+  return 0;
+}
+
+// session:send(bytes): send complete MIDI messages, given as a string or a
+// table of bytes, to all connected peers. Returns the number of peers.
+static int l_send(lua_State *L)
+{
+  session_t *s = checksession(L, 1);
+  uint8_t buf[LIST_MAX];
+  const uint8_t *data;
+  size_t len;
+  int n;
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    size_t i;
+    len = lua_rawlen(L, 2);
+    if (len > LIST_MAX) return luaL_error(L, "rtpmidi: too much data");
+    for (i = 0; i < len; i++) {
+      lua_rawgeti(L, 2, i+1);
+      buf[i] = lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    }
+    data = buf;
+  } else {
+    data = (const uint8_t*)luaL_checklstring(L, 2, &len);
+  }
+  if ((n = send_midi(s, data, len)) < 0)
+    return luaL_error(L, "rtpmidi: bad or too much MIDI data");
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+// session:drop([n]): drop the next n (1 by default) outgoing MIDI packets,
+// as if they had been lost on the way. This is for testing the recovery
+// journal, see rtptest.lua.
+static int l_drop(lua_State *L)
+{
+  session_t *s = checksession(L, 1);
+  s->drop = luaL_optinteger(L, 2, 1);
+  return 0;
+}
+
+// session:poll(): process all pending input and timers. Returns a list of
+// events: {"connected", name, addr, port}, {"disconnected", name},
+// {"latency", name, msec} and {"midi", name, bytes}, with the MIDI data as a
+// string.
+static int l_poll(lua_State *L)
+{
+  session_t *s = checksession(L, 1);
+  int n = 0;
+  lua_newtable(L);
+  receive(L, &n, s, 0);
+  receive(L, &n, s, 1);
+  timers(L, &n, s);
+  return 1;
+}
+
+// session:peers(): list of peers, as tables with the name, addr, port,
+// latency (msec, -1 if not known yet) and connected (boolean) fields.
+static int l_peers(lua_State *L)
+{
+  session_t *s = checksession(L, 1);
+  char buf[INET_ADDRSTRLEN];
+  int i, n = 0;
+  lua_newtable(L);
+  for (i = 0; i < MAX_PEERS; i++) {
+    peer_t *p = &s->peers[i];
+    if (p->state == P_FREE || p->state == P_ACCEPTED) continue;
+    lua_createtable(L, 0, 5);
+    lua_pushstring(L, p->name);
+    lua_setfield(L, -2, "name");
+    lua_pushstring(L, addrstr(&p->ctl, buf));
+    lua_setfield(L, -2, "addr");
+    lua_pushinteger(L, ntohs(p->ctl.sin_port));
+    lua_setfield(L, -2, "port");
+    lua_pushnumber(L, p->latency);
+    lua_setfield(L, -2, "latency");
+    lua_pushboolean(L, p->state == P_CONNECTED);
+    lua_setfield(L, -2, "connected");
+    lua_rawseti(L, -2, ++n);
+  }
+  return 1;
+}
+
+/* Module. *****************************************************************/
+
+static const struct luaL_Reg session_methods [] = {
+  {"close", l_close},
+  {"port", l_port},
+  {"fds", l_fds},
+  {"invite", l_invite},
+  {"bye", l_bye},
+  {"send", l_send},
+  {"drop", l_drop},
+  {"poll", l_poll},
+  {"peers", l_peers},
+  {NULL, NULL}  /* sentinel */
+};
+
+static const struct luaL_Reg rtpmidi [] = {
+  {"open", l_open},
+  {NULL, NULL}  /* sentinel */
+};
+
+int luaopen_rtpmidi (lua_State *L) {
+  if (luaL_newmetatable(L, SESSION)) {
+    lua_pushcfunction(L, l_close);
+    lua_setfield(L, -2, "__gc");
+    lua_newtable(L);
+    luaL_setfuncs(L, session_methods, 0);
+    lua_setfield(L, -2, "__index");
+  }
+  lua_pop(L, 1);
+  luaL_newlib(L, rtpmidi);
+  return 1;
+}
@@ -0,0 +1,81 @@
+-- Loopback test for the rtpmidi module. Run this with `make test` (or
+-- `lua rtptest.lua` after `make`). Two sessions on 127.0.0.1 connect, send
+-- some notes both ways, and then a dropped packet is recovered from the
+-- journal of the next one.
+
+-- Author: Albert Gräf <aggraef@gmail.com>, Dept. of Music-Informatics,
+-- Johannes Gutenberg University (JGU) of Mainz, Germany, please check
+-- https://agraef.github.io/ for a list of my software.
+
+-- Distributed under the GPLv3+, please check the accompanying COPYING file
+-- for details.
+
+package.cpath = "./?.so;" .. package.cpath
+local rtp = require 'rtpmidi'
+
+local a = assert(rtp.open("A", 0))
+local b = assert(rtp.open("B", 0))
+
+-- MIDI data received by each session
+local midi = { [a] = "", [b] = "" }
+
+local function pump(s)
+   for _, ev in ipairs(s:poll()) do
+      if ev[1] == "midi" then
+	 midi[s] = midi[s] .. ev[3]
+      end
+   end
+end
+
+-- poll both sessions until cond() holds, give up after 5 seconds
+local function run(cond, what)
+   local deadline = os.time() + 5
+   while not cond() do
+      if os.time() > deadline then
+	 error("timeout: " .. what, 2)
+      end
+      pump(a)
+      pump(b)
+   end
+end
+
+local function connected(s)
+   local peers = s:peers()
+   return #peers == 1 and peers[1].connected
+end
+
+local function hex(s)
+   return (s:gsub(".", function(c)
+      return string.format("%02x ", c:byte())
+   end))
+end
+
+local function expect(s, data, what)
+   run(function() return midi[s]:find(data, 1, true) end, what)
+   midi[s] = ""
+end
+
+assert(a:invite("127.0.0.1", tostring(b:port())))
+run(function() return connected(a) and connected(b) end, "connect")
+
+-- notes both ways
+assert(a:send("\x90\x3c\x64") == 1)
+expect(b, "\x90\x3c\x64", "note A -> B")
+assert(b:send({0x91, 0x40, 0x50}) == 1)
+expect(a, "\x91\x40\x50", "note B -> A")
+assert(a:send("\x80\x3c\x00") == 1)
+expect(b, "\x80\x3c\x00", "note off A -> B")
+
+-- the next note is lost, and must be recovered from the journal of the
+-- note after it
+a:drop()
+assert(a:send("\x90\x3e\x64") == 1)
+assert(a:send("\x90\x43\x64") == 1)
+run(function() return midi[b]:find("\x90\x43\x64", 1, true) end, "recovery")
+assert(midi[b]:find("\x90\x3e\x64", 1, true),
+       "lost note not recovered, got " .. hex(midi[b]))
+
+a:bye()
+a:close()
+b:close()
+print("rtptest: all tests passed")
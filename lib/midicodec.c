@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#ifndef DEBUG
+// Set this to a nonzero value to enable debugging output.
+#define DEBUG 0
+#endif
+
+// SMMF (symbolic MIDI message format) codec. This translates raw MIDI byte
+// streams to SMMF messages and vice versa, as an efficient replacement for
+// the byte-wise sysex handling in the midi-input and midi-output
+// abstractions. The message format is the same as the one used by those
+// abstractions, i.e.:
+
+// note num vel chan, ctl val num chan, polytouch val num chan, pgm prog chan,
+// bend val chan, touch val chan, start, cont, stop, sysex byte ...
+
+// MIDI channels are 1-based as usual, with port numbers encoded as an offset
+// of 16 (i.e., channel 17 denotes channel 1 on the 2nd port), and program
+// numbers are 1-based (like Pd's pgmin and pgmout objects). Pitch bends are
+// signed in the range -8192..8191. Sysex data excludes the leading 0xf0 and
+// trailing 0xf7 bytes.
+
+// Initial size and upper bound for the sysex buffer.
+#define SYSEX_INIT 256
+#define SYSEX_MAX 65536
+
+#define DECODER "midicodec.decoder"
+
+typedef struct {
+  int status;		// current (running) status byte, 0 if none
+  int count, need;	// number of data bytes collected / needed
+  unsigned char data[2];
+  int in_sysex;		// set while collecting sysex data
+  int overflow;		// set if the sysex data exceeds SYSEX_MAX
+  unsigned char *sysex;
+  size_t len, size;
+} decoder_t;
+
+/* Decoder. ****************************************************************/
+
+static void push_msg(lua_State *L, const char *sel, int n, const int *args)
+{
+  int i;
+  lua_pushstring(L, sel);
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_pushinteger(L, args[i]);
+    lua_rawseti(L, -2, i+1);
+  }
+}
+
+static void push_sysex(lua_State *L, decoder_t *d)
+{
+  size_t i;
+  lua_pushstring(L, "sysex");
+  lua_createtable(L, d->len, 0);
+  for (i = 0; i < d->len; i++) {
+    lua_pushinteger(L, d->sysex[i]);
+    lua_rawseti(L, -2, i+1);
+  }
+  d->len = 0;
+}
+
+static void add_sysex(decoder_t *d, unsigned char b)
+{
+  if (d->overflow) return;
+  if (d->len >= d->size) {
+    size_t size = d->size ? 2*d->size : SYSEX_INIT;
+    unsigned char *buf;
+    if (size > SYSEX_MAX || !(buf = realloc(d->sysex, size))) {
+#if DEBUG
+      fprintf(stderr, "midicodec: sysex message too large, dropped\n");
+#endif
+      // drop the entire message, it will be skipped at the end
+      d->overflow = 1;
+      d->len = 0;
+      return;
+    }
+    d->sysex = buf;
+    d->size = size;
+  }
+  d->sysex[d->len++] = b;
+}
+
+// Feed a single byte to the decoder. If this completes a message, it is
+// pushed onto the Lua stack as a selector-atoms pair, and the function
+// returns 2. Otherwise nothing is pushed and the function returns 0. Note
+// that a status byte may terminate a pending sysex message, in which case
+// the sysex message is returned and the status byte is processed right away.
+static int decode_byte(lua_State *L, decoder_t *d, int b, int port)
+{
+  int args[3], chan;
+  b &= 0xff;
+  if (b >= 0xf8) {
+    // system realtime, these may be interspersed with anything else
+    static const char *rt[] = { "start", "cont", "stop" };
+    if (b >= 0xfa && b <= 0xfc) {
+      push_msg(L, rt[b-0xfa], 0, NULL);
+      return 2;
+    }
+    return 0;
+  }
+  if (b >= 0x80) {
+    int ret = 0;
+    if (d->in_sysex) {
+      // any status byte terminates the sysex message
+      d->in_sysex = 0;
+      if (!d->overflow) {
+	push_sysex(L, d);
+	ret = 2;
+      }
+    }
+    if (b == 0xf0) {
+      d->in_sysex = 1;
+      d->overflow = 0;
+      d->len = 0;
+      d->status = 0;
+    } else if (b >= 0xf1) {
+      // system common, these cancel running status; we only need to skip
+      // over their data bytes here
+      d->status = b;
+      d->need = (b == 0xf2) ? 2 : (b == 0xf1 || b == 0xf3) ? 1 : 0;
+      if (!d->need) d->status = 0;
+    } else {
+      d->status = b;
+      d->need = (b >= 0xc0 && b < 0xe0) ? 1 : 2;
+    }
+    d->count = 0;
+    return ret;
+  }
+  if (d->in_sysex) {
+    add_sysex(d, b);
+    return 0;
+  }
+  if (!d->status) return 0; // stray data byte, ignore
+  d->data[d->count++] = b;
+  if (d->count < d->need) return 0;
+  d->count = 0;
+  if (d->status >= 0xf0) {
+    // system common message is complete, we don't report these
+    d->status = 0;
+    return 0;
+  }
+  chan = (d->status & 0x0f) + 1 + 16*port;
+  switch (d->status & 0xf0) {
+  case 0x80:
+    args[0] = d->data[0]; args[1] = 0; args[2] = chan;
+    push_msg(L, "note", 3, args);
+    break;
+  case 0x90:
+    args[0] = d->data[0]; args[1] = d->data[1]; args[2] = chan;
+    push_msg(L, "note", 3, args);
+    break;
+  case 0xa0:
+    args[0] = d->data[1]; args[1] = d->data[0]; args[2] = chan;
+    push_msg(L, "polytouch", 3, args);
+    break;
+  case 0xb0:
+    args[0] = d->data[1]; args[1] = d->data[0]; args[2] = chan;
+    push_msg(L, "ctl", 3, args);
+    break;
+  case 0xc0:
+    args[0] = d->data[0]+1; args[1] = chan;
+    push_msg(L, "pgm", 2, args);
+    break;
+  case 0xd0:
+    args[0] = d->data[0]; args[1] = chan;
+    push_msg(L, "touch", 2, args);
+    break;
+  default: // 0xe0
+    args[0] = ((d->data[1] << 7) | d->data[0]) - 8192; args[1] = chan;
+    push_msg(L, "bend", 2, args);
+    break;
+  }
+  return 2;
+}
+
+/* Encoder. ****************************************************************/
+
+static int getint(lua_State *L, int t, int i, int a, int b)
+{
+  int x;
+  lua_rawgeti(L, t, i);
+  x = lua_isnumber(L, -1) ? (int)lua_tonumber(L, -1) : a;
+  lua_pop(L, 1);
+  return x < a ? a : x > b ? b : x;
+}
+
+// Encode the SMMF message with the given selector and atoms table at stack
+// index t into the buffer buf (which must be large enough). Returns the
+// number of bytes, or -1 if the message isn't a valid SMMF message. The port
+// number encoded in the MIDI channel is returned in *port.
+static int encode_msg(lua_State *L, const char *sel, int t,
+		      unsigned char *buf, int *port)
+{
+  int n = 0, chan;
+  *port = 0;
+  if (!strcmp(sel, "start")) {
+    buf[n++] = 0xfa;
+  } else if (!strcmp(sel, "cont")) {
+    buf[n++] = 0xfb;
+  } else if (!strcmp(sel, "stop")) {
+    buf[n++] = 0xfc;
+  } else if (!strcmp(sel, "sysex")) {
+    int i, len = lua_rawlen(L, t);
+    buf[n++] = 0xf0;
+    for (i = 1; i <= len; i++) {
+      int b = getint(L, t, i, 0, 255);
+      // skip any explicit start and end bytes
+      if (b == 0xf0 || b == 0xf7) continue;
+      buf[n++] = b & 0x7f;
+    }
+    buf[n++] = 0xf7;
+  } else {
+    int status, arity, a, b;
+    if (!strcmp(sel, "note")) {
+      status = 0x90; arity = 3;
+    } else if (!strcmp(sel, "ctl")) {
+      status = 0xb0; arity = 3;
+    } else if (!strcmp(sel, "polytouch")) {
+      status = 0xa0; arity = 3;
+    } else if (!strcmp(sel, "pgm")) {
+      status = 0xc0; arity = 2;
+    } else if (!strcmp(sel, "bend")) {
+      status = 0xe0; arity = 2;
+    } else if (!strcmp(sel, "touch")) {
+      status = 0xd0; arity = 2;
+    } else
+      return -1;
+    chan = getint(L, t, arity, 1, 256) - 1;
+    *port = chan / 16;
+    buf[n++] = status | (chan & 0x0f);
+    switch (status) {
+    case 0x90:
+      buf[n++] = getint(L, t, 1, 0, 127);
+      buf[n++] = getint(L, t, 2, 0, 127);
+      break;
+    case 0xa0: case 0xb0:
+      // value comes first in SMMF
+      a = getint(L, t, 1, 0, 127);
+      b = getint(L, t, 2, 0, 127);
+      buf[n++] = b; buf[n++] = a;
+      break;
+    case 0xc0:
+      buf[n++] = getint(L, t, 1, 1, 128) - 1;
+      break;
+    case 0xd0:
+      buf[n++] = getint(L, t, 1, 0, 127);
+      break;
+    default: // 0xe0
+      a = getint(L, t, 1, -8192, 8191) + 8192;
+      buf[n++] = a & 0x7f; buf[n++] = a >> 7;
+      break;
+    }
+  }
+  return n;
+}
+
+/* Lua API. ****************************************************************/
+
+static decoder_t *checkdecoder(lua_State *L, int i)
+{
+  return (decoder_t*)luaL_checkudata(L, i, DECODER);
+}
+
+static int l_decoder(lua_State *L)
+{
+  decoder_t *d = (decoder_t*)lua_newuserdata(L, sizeof(decoder_t));
+  memset(d, 0, sizeof(decoder_t));
+  luaL_setmetatable(L, DECODER);
+  return 1;
+}
+
+static int l_decoder_gc(lua_State *L)
+{
+  decoder_t *d = checkdecoder(L, 1);
+  free(d->sysex);
+  d->sysex = NULL;
+  d->len = d->size = 0;
+  return 0;
+}
+
+// decode(dec, byte [, port]): feed a single byte, returns selector and atoms
+// of a completed message, if any.
+static int l_decode(lua_State *L)
+{
+  decoder_t *d = checkdecoder(L, 1);
+  int b = luaL_checkinteger(L, 2);
+  int port = luaL_optinteger(L, 3, 0);
+  return decode_byte(L, d, b, port);
+}
+
+// decodebuf(dec, bytes [, port]): feed an entire buffer of bytes (either a
+// string or a table of numbers) in one go, returns a table with all completed
+// messages as {selector, atoms} pairs.
+static int l_decodebuf(lua_State *L)
+{
+  decoder_t *d = checkdecoder(L, 1);
+  int port = luaL_optinteger(L, 3, 0), k = 0;
+  size_t i, len;
+  const char *s = NULL;
+  if (lua_type(L, 2) == LUA_TSTRING)
+    s = lua_tolstring(L, 2, &len);
+  else {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    len = lua_rawlen(L, 2);
+  }
+  lua_newtable(L);
+  for (i = 0; i < len; i++) {
+    int b;
+    if (s)
+      b = (unsigned char)s[i];
+    else {
+      lua_rawgeti(L, 2, i+1);
+      b = lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    }
+    // A status byte may complete a pending sysex message *and* start a new
+    // message, but a single byte never completes more than one message, so
+    // this always yields 0 or 2 results.
+    if (decode_byte(L, d, b, port)) {
+      lua_createtable(L, 2, 0);
+      lua_insert(L, -3);
+      lua_rawseti(L, -3, 2);
+      lua_rawseti(L, -2, 1);
+      lua_rawseti(L, -2, ++k);
+    }
+  }
+  return 1;
+}
+
+// encode(sel, atoms [, str]): encode an SMMF message, returns the bytes as a
+// table of numbers (or a string if str is true), along with the 0-based port
+// number, or nothing if the message isn't a valid SMMF message.
+static int l_encode(lua_State *L)
+{
+  const char *sel = luaL_checkstring(L, 1);
+  int str = lua_toboolean(L, 3), port, n, i;
+  unsigned char tmp[16], *buf = tmp;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (!strcmp(sel, "sysex")) {
+    // only sysex messages may need more than a few bytes
+    size_t len = lua_rawlen(L, 2) + 2;
+    if (len > sizeof(tmp) && !(buf = malloc(len)))
+      return luaL_error(L, "midicodec: out of memory");
+  }
+  n = encode_msg(L, sel, 2, buf, &port);
+  if (n < 0) {
+    if (buf != tmp) free(buf);
+    return 0;
+  }
+  if (str)
+    lua_pushlstring(L, (const char*)buf, n);
+  else {
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+      lua_pushinteger(L, buf[i]);
+      lua_rawseti(L, -2, i+1);
+    }
+  }
+  if (buf != tmp) free(buf);
+  lua_pushinteger(L, port);
+  return 2;
+}
+
+static const struct luaL_Reg midicodec [] = {
+  {"decoder", l_decoder},
+  {"decode", l_decode},
+  {"decodebuf", l_decodebuf},
+  {"encode", l_encode},
+  {NULL, NULL}  /* sentinel */
+};
+
+int luaopen_midicodec (lua_State *L) {
+  if (luaL_newmetatable(L, DECODER)) {
+    lua_pushcfunction(L, l_decoder_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_pop(L, 1);
+  luaL_newlib(L, midicodec);
+  return 1;
+}
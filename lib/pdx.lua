@@ -5,9 +5,12 @@ Copyright (C) 2020 Albert Gräf <aggraef@gmail.com>
 
 To use this in your pd-lua scripts: local pdx = require 'pdx'
 
-Currently there's only the pdx.reload() function, which implements a kind of
+Currently there's the pdx.reload() function, which implements a kind of
 remote reload functionality based on dofile and receivers, as explained in the
-pd-lua tutorial. More may be added in the future.
+pd-lua tutorial, a bytecode cache which speeds up loading Lua scripts
+(pdx.loadfile() and friends), a profiler for pd-lua objects
+(pdx.profile()), and persistent state (pdx.save() and pdx.restore()). More
+may be added in the future.
 
 This program is free software; you can redistribute it and/or
 modify it under the terms of the GNU General Public License
@@ -26,6 +29,191 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 local pdx = {}
 
+--[[
+Bytecode cache. pdx.loadfile() works like loadfile(), but keeps the compiled
+chunk in a cache file, so that the script doesn't need to be parsed and
+compiled again the next time it is loaded, as long as it is unchanged. Each
+cache file holds a copy of the source along with the bytecode, and is only
+used if the source still matches, so edits invalidate the cache entry
+automatically (plain Lua has no way to get at a file's mtime, and this also
+catches edits within the same second). Once pdx is loaded, modules loaded
+with require go through the cache as well, and so do the scripts reloaded
+by pdx.reload. Note that the cache's searcher is added to package.searchers,
+which is shared by all Lua objects in the Pd instance, so this affects the
+require calls of every pd-lua object, not just those using pdx.
+
+The cache files live in pdx.cachedir, which is $XDG_CACHE_HOME/pdx or
+~/.cache/pdx by default (%LOCALAPPDATA%\pdx on Windows). Set pdx.cachedir to
+nil to disable caching. If the directory can't be created, caching is
+disabled automatically. (Creating it needs a shell command, which blocks Pd
+for a moment, but this is only done once.) Cache files are written to a
+temporary file first, which then replaces the old file, so that other Pd
+instances never get to see a partially written cache file.
+--]]
+
+local windows = package.config:sub(1, 1) == "\\"
+
+local function default_cachedir()
+   if windows then
+      local dir = os.getenv("LOCALAPPDATA")
+      return dir and dir .. "\\pdx"
+   end
+   local dir = os.getenv("XDG_CACHE_HOME")
+   if dir and dir ~= "" then
+      return dir .. "/pdx"
+   end
+   dir = os.getenv("HOME")
+   return dir and dir .. "/.cache/pdx"
+end
+
+pdx.cachedir = default_cachedir()
+
+-- cache file header, the source length follows; the Lua version is included
+-- since bytecode isn't portable between Lua versions
+local magic = "pdx-cache " .. _VERSION .. " "
+
+local function readfile(path)
+   local fp = io.open(path, "rb")
+   if fp then
+      local s = fp:read("a")
+      fp:close()
+      return s
+   end
+end
+
+local function cachefile(path)
+   -- the cache file name is the path of the script, with all directory
+   -- separators replaced, so that each script gets its own cache file
+   local sep = windows and "\\" or "/"
+   return pdx.cachedir .. sep .. string.gsub(path, "[/\\:]", "%%")
+end
+
+-- create a directory along with its parents; the path gets quoted for the
+-- shell (double quotes can't occur in Windows file names)
+local function mkdir(dir)
+   if windows then
+      os.execute(string.format('mkdir "%s"', dir))
+   else
+      dir = string.gsub(dir, "'", "'\\''")
+      os.execute(string.format("mkdir -p -- '%s'", dir))
+   end
+end
+
+-- suffix of our temporary files, unique to this Pd instance (more or less,
+-- the address of a table will do), so that concurrent writers don't mix up
+-- their data
+local tmpsuffix = "." .. string.match(tostring({}), "%x+$") .. ".tmp"
+
+local function writecache(file, src, chunk)
+   local tmp = file .. tmpsuffix
+   local fp = io.open(tmp, "wb")
+   if not fp then
+      -- cache directory doesn't exist yet, try to create it
+      mkdir(pdx.cachedir)
+      fp = io.open(tmp, "wb")
+      if not fp then
+	 pdx.cachedir = nil
+	 return
+      end
+   end
+   fp:write(magic, #src, "\n", src, string.dump(chunk))
+   fp:close()
+   if windows then
+      -- rename doesn't replace an existing file on Windows
+      os.remove(file)
+   end
+   if not os.rename(tmp, file) then
+      os.remove(tmp)
+   end
+end
+
+function pdx.loadfile(path)
+   local src = readfile(path)
+   if not src then
+      return nil, string.format("cannot open %s", path)
+   end
+   local name = "@" .. path
+   if pdx.cachedir then
+      local file = cachefile(path)
+      local data = readfile(file)
+      local hdr = data and #magic + #tostring(#src) + 1
+      if hdr and string.sub(data, 1, hdr) == magic .. #src .. "\n" and
+	 string.sub(data, hdr+1, hdr+#src) == src then
+	 local chunk = load(string.sub(data, hdr+#src+1), name, "b")
+	 if chunk then
+	    return chunk
+	 end
+      end
+      local chunk, err = load(src, name, "t")
+      if chunk then
+	 writecache(file, src, chunk)
+      end
+      return chunk, err
+   end
+   return load(src, name, "t")
+end
+
+function pdx.dofile(path, ...)
+   local chunk = assert(pdx.loadfile(path))
+   return chunk(...)
+end
+
+-- package searcher for Lua modules, loaded through the cache
+local function searcher(name)
+   local path = package.searchpath(name, package.path)
+   if not path then
+      -- the standard searcher will tell where we looked
+      return nil
+   end
+   local chunk, err = pdx.loadfile(path)
+   if not chunk then
+      error(string.format("error loading module '%s' from file '%s':\n\t%s",
+			  name, path, err), 2)
+   end
+   return chunk, path
+end
+
+-- this goes right before the standard Lua searcher; package.searchers is
+-- global to the Pd instance, so all pd-lua objects use the cache from now on
+table.insert(package.searchers, 2, searcher)
+
+-- Find a script on the Lua search path (pd-lua adds the directories of all
+-- loaded scripts there), returns its full path, or nil if not found.
+local function exists(path)
+   local fp = io.open(path)
+   if fp then
+      fp:close()
+      return true
+   end
+end
+
+local function findscript(name)
+   if exists(name) then
+      return name
+   end
+   for dir in string.gmatch(package.path, "([^;]*)[/\\]%?%.lua") do
+      local path = dir .. "/" .. name
+      if exists(path) then
+	 return path
+      end
+   end
+end
+
+-- Reload an object's script, through the cache if the script can be found
+-- on the search path, otherwise with pd-lua's dofilex.
+local function reload(self)
+   local path = findscript(self._scriptname)
+   local chunk, err = path and pdx.loadfile(path)
+   if chunk then
+      local ok, err = pcall(chunk)
+      if not ok then
+	 pd.post(string.format("pdx: error reloading %s: %s", self._name, err))
+      end
+   else
+      self:dofilex(self._scriptname)
+   end
+end
+
 --[[
 Reload functionality. Call pdx.reload() on your object to enable, and
 pdx.unreload() to disable this functionality again.
@@ -59,28 +247,36 @@ local function finalize(self)
    end
 end
 
--- Our receiver. In the future, more functionality may be added here, but at
--- present this only recognizes the "reload" message and checks the class
--- name, if given.
+-- forward declarations (see the profiling section below)
+local profile_msg, rewrap
+
+-- Our receiver. At present this recognizes the "reload" message (if reloading
+-- is enabled for the class) and checks the class name, if given, as well as
+-- the "profile" messages (see below).
 local function pdluax(self, sel, atoms)
-   if sel == "reload" then
+   if sel == "reload" and reloadables[self._name].reload then
       -- reload message, check that any extra argument matches the class name
       if atoms[1] == nil or atoms[1] == self._name then
 	 pd.post(string.format("pdx: reloading %s", self._name))
-	 self:dofilex(self._scriptname)
+	 reload(self)
 	 -- update the object's finalizer and restore our own, in case
 	 -- anything has changed there
 	 if self.finalize ~= finalize then
 	    reloadables[self._name][self].finalize = self.finalize
 	    self.finalize = finalize
 	 end
+	 -- profile any new methods
+	 rewrap(self._name)
       end
+   elseif sel == "profile" then
+      profile_msg(self, atoms)
    end
 end
 
 -- purge an object from the reloadables table
 function pdx.unreload(self)
    if reloadables[self._name] then
+      pdx.unprofile(self)
       if reloadables[self._name].current == self then
 	 -- self is the current receiver, find another one
 	 local current = nil
@@ -112,7 +308,7 @@ function pdx.unreload(self)
 end
 
 -- register a new object in the reloadables table
-function pdx.reload(self)
+local function join(self)
    if reloadables[self._name] then
       -- We already have an object for this class, simply record the new one
       -- and install our finalizer so that we can perform the necessary
@@ -136,4 +332,338 @@ function pdx.reload(self)
    end
 end
 
+function pdx.reload(self)
+   join(self)
+   reloadables[self._name].reload = true
+end
+
+--[[
+Profiling. Call pdx.profile() on your object to enable, and pdx.unprofile()
+to disable this functionality again (pdx.unreload() also does that).
+
+pdx.profile wraps all methods of the object's class (inlet methods, clock
+callbacks, and the helper methods these call) as well as the object's
+outlet method, and records the number of calls, the total and maximum time
+spent in each of them, and the memory allocated during the calls (in KB,
+as reported by collectgarbage). Times include the methods called from a
+method, and for the outlet method, the processing in the objects
+downstream.
+
+The results are printed in the Pd console, summed up over all profiled
+objects in the class, when the "pdluax" receiver gets the "profile" message
+(the class name can be given as an extra argument, as with reload). "profile
+reset" resets the counters. "profile sample n" also starts a sampling
+profiler which records the current source line every n Lua VM instructions
+(using debug.sethook), and "profile sample 0" stops it again; the lines of
+the class script with the most samples are then included in the report.
+Note that sampling slows down all Lua code in Pd, not just the profiled
+objects.
+
+Times are taken with pdx.clock, which is os.clock by default. That's the CPU
+time of the process, which is all that plain Lua offers; you can set
+pdx.clock to a function returning the wall-clock time in seconds if you
+have one.
+--]]
+
+pdx.clock = os.clock
+
+-- methods which aren't profiled
+local unprofiled = { initialize = true, postinitialize = true,
+		     finalize = true }
+
+local function record(s, t0, m0, ...)
+   local t = pdx.clock() - t0
+   local m = collectgarbage("count") - m0
+   s.calls = s.calls + 1
+   s.total = s.total + t
+   if t > s.max then
+      s.max = t
+   end
+   -- a garbage collection cycle may have freed more than we allocated
+   if m > 0 then
+      s.alloc = s.alloc + m
+   end
+   return ...
+end
+
+local function wrap(self, stats, name)
+   if stats[name] or rawget(self, name) ~= nil then
+      return
+   end
+   local s = { calls = 0, total = 0, max = 0, alloc = 0 }
+   stats[name] = s
+   self[name] = function(obj, ...)
+      -- look up the method each time, so that reloads take effect
+      local f = getmetatable(obj)[name]
+      return record(s, pdx.clock(), collectgarbage("count"), f(obj, ...))
+   end
+end
+
+local function wrap_all(self, stats)
+   for name, f in pairs(getmetatable(self)) do
+      if type(f) == "function" and type(name) == "string" and
+	 not unprofiled[name] and string.sub(name, 1, 1) ~= "_" then
+	 wrap(self, stats, name)
+      end
+   end
+   wrap(self, stats, "outlet")
+end
+
+function rewrap(name)
+   for obj, data in pairs(reloadables[name]) do
+      if type(obj) == "table" and data.profile then
+	 wrap_all(obj, data.profile)
+      end
+   end
+end
+
+-- samples taken by the sampling profiler, indexed by source and line, and
+-- the sampling interval (0 = off)
+local samples, nsamples, interval = {}, 0, 0
+
+local function sample()
+   local info = debug.getinfo(2, "Sl")
+   if info then
+      local lines = samples[info.source] or {}
+      samples[info.source] = lines
+      lines[info.currentline] = (lines[info.currentline] or 0) + 1
+      nsamples = nsamples + 1
+   end
+end
+
+local function set_sampling(n)
+   -- we get this message once for each profiled class, so only act on it if
+   -- something changes
+   n = type(n) == "number" and math.max(0, math.floor(n)) or 0
+   if n ~= interval then
+      interval = n
+      samples, nsamples = {}, 0
+      if n > 0 then
+	 debug.sethook(sample, "", n)
+      else
+	 debug.sethook()
+      end
+   end
+end
+
+local function reset(name)
+   for obj, data in pairs(reloadables[name]) do
+      if type(obj) == "table" and data.profile then
+	 for _, s in pairs(data.profile) do
+	    s.calls, s.total, s.max, s.alloc = 0, 0, 0, 0
+	 end
+      end
+   end
+   samples, nsamples = {}, 0
+end
+
+local function report(self)
+   local name = self._name
+   local total, count = {}, 0
+   for obj, data in pairs(reloadables[name]) do
+      if type(obj) == "table" and data.profile then
+	 count = count + 1
+	 for m, s in pairs(data.profile) do
+	    local t = total[m] or { calls = 0, total = 0, max = 0, alloc = 0 }
+	    total[m] = t
+	    t.calls = t.calls + s.calls
+	    t.total = t.total + s.total
+	    t.max = math.max(t.max, s.max)
+	    t.alloc = t.alloc + s.alloc
+	 end
+      end
+   end
+   if count == 0 then
+      return
+   end
+   pd.post(string.format("pdx: profile of %s (%d object%s)", name, count,
+			 count == 1 and "" or "s"))
+   -- methods by total time
+   local names = {}
+   for m, t in pairs(total) do
+      if t.calls > 0 then
+	 table.insert(names, m)
+      end
+   end
+   table.sort(names, function(a, b) return total[a].total > total[b].total end)
+   for _, m in ipairs(names) do
+      local t = total[m]
+      pd.post(string.format("%-20s %8d calls %10.3f ms %8.3f ms avg " ..
+			    "%8.3f ms max %10.1f KB", m, t.calls,
+			    t.total*1000, t.total*1000/t.calls, t.max*1000,
+			    t.alloc))
+   end
+   -- the 10 lines of the script with the most samples
+   if nsamples > 0 then
+      local script = string.match(self._scriptname or name, "[^/\\]*$")
+      local lines = {}
+      for src, l in pairs(samples) do
+	 if string.sub(src, -#script) == script then
+	    for line, n in pairs(l) do
+	       table.insert(lines, {line, n})
+	    end
+	 end
+      end
+      table.sort(lines, function(a, b) return a[2] > b[2] end)
+      for i = 1, math.min(10, #lines) do
+	 pd.post(string.format("%s:%d: %d samples (%.1f%%)", script,
+			       lines[i][1], lines[i][2],
+			       100*lines[i][2]/nsamples))
+      end
+   end
+end
+
+function profile_msg(self, atoms)
+   local cmd = atoms[1]
+   if cmd == "sample" then
+      set_sampling(atoms[2])
+   elseif cmd == "reset" then
+      if atoms[2] == nil or atoms[2] == self._name then
+	 reset(self._name)
+      end
+   elseif cmd == nil or cmd == self._name then
+      report(self)
+   end
+end
+
+function pdx.profile(self)
+   join(self)
+   local data = reloadables[self._name][self]
+   if not data.profile then
+      data.profile = {}
+      wrap_all(self, data.profile)
+   end
+end
+
+function pdx.unprofile(self)
+   local data = reloadables[self._name] and reloadables[self._name][self]
+   if data and data.profile then
+      for name in pairs(data.profile) do
+	 self[name] = nil
+      end
+      data.profile = nil
+   end
+end
+
+--[[
+Persistent state. pdx.save(name, t) writes the table t to the state file of
+the given name in pdx.statedir, pdx.restore(name) reads it back, returning
+nil if there's no such file or it can't be read. The table may contain
+numbers, strings, booleans and (non-recursive) tables; anything else makes
+pdx.save fail, returning false and an error message. It is written as a
+Lua table constructor to a temporary file, which is then renamed, so that a
+crash in the middle of a write doesn't clobber the previous state.
+
+pdx.statedir is $XDG_STATE_HOME/pdx or ~/.local/state/pdx by default
+(%LOCALAPPDATA%\pdx\state on Windows). Set it to nil to disable saving.
+--]]
+
+local function default_statedir()
+   if windows then
+      local dir = os.getenv("LOCALAPPDATA")
+      return dir and dir .. "\\pdx\\state"
+   end
+   local dir = os.getenv("XDG_STATE_HOME")
+   if dir and dir ~= "" then
+      return dir .. "/pdx"
+   end
+   dir = os.getenv("HOME")
+   return dir and dir .. "/.local/state/pdx"
+end
+
+pdx.statedir = default_statedir()
+
+local function statefile(name)
+   local sep = windows and "\\" or "/"
+   return pdx.statedir .. sep .. string.gsub(name, "[/\\:]", "%%") .. ".lua"
+end
+
+local function serialize(x, buf)
+   if type(x) == "table" then
+      table.insert(buf, "{")
+      for _, v in ipairs(x) do
+	 serialize(v, buf)
+	 table.insert(buf, ",")
+      end
+      for k, v in pairs(x) do
+	 if math.type(k) ~= "integer" or k < 1 or k > #x then
+	    table.insert(buf, "[")
+	    serialize(k, buf)
+	    table.insert(buf, "]=")
+	    serialize(v, buf)
+	    table.insert(buf, ",")
+	 end
+      end
+      table.insert(buf, "}")
+   elseif type(x) == "string" then
+      table.insert(buf, string.format("%q", x))
+   elseif math.type(x) == "integer" then
+      table.insert(buf, string.format("%d", x))
+   elseif type(x) == "number" then
+      -- %q only takes numbers as of Lua 5.4, and %.17g is exact; inf and
+      -- nan have no literal, so they're written as expressions
+      if x ~= x then
+	 table.insert(buf, "(0/0)")
+      elseif x == math.huge or x == -math.huge then
+	 table.insert(buf, x > 0 and "(1/0)" or "(-1/0)")
+      else
+	 local s = string.format("%.17g", x)
+	 -- make sure that it reads back as a float
+	 if not string.find(s, "[.eEn]") then
+	    s = s .. ".0"
+	 end
+	 table.insert(buf, s)
+      end
+   elseif type(x) == "boolean" then
+      table.insert(buf, tostring(x))
+   else
+      -- functions, userdata etc. can't be saved
+      error("can't save a value of type " .. type(x), 0)
+   end
+end
+
+function pdx.save(name, t)
+   if not pdx.statedir then
+      return false
+   end
+   local buf = { "return " }
+   local ok, err = pcall(serialize, t, buf)
+   if not ok then
+      return false, err
+   end
+   local file = statefile(name)
+   local tmp = file .. tmpsuffix
+   local fp = io.open(tmp, "wb")
+   if not fp then
+      -- state directory doesn't exist yet, try to create it
+      mkdir(pdx.statedir)
+      fp = io.open(tmp, "wb")
+      if not fp then
+	 return false
+      end
+   end
+   fp:write(table.concat(buf), "\n")
+   fp:close()
+   if windows then
+      -- rename doesn't replace an existing file on Windows
+      os.remove(file)
+   end
+   return os.rename(tmp, file) ~= nil
+end
+
+function pdx.restore(name)
+   if not pdx.statedir then
+      return nil
+   end
+   local data = readfile(statefile(name))
+   -- the state is data only, so it gets an empty environment
+   local chunk = data and load(data, "=" .. name, "t", {})
+   if chunk then
+      local ok, t = pcall(chunk)
+      if ok and type(t) == "table" then
+	 return t
+      end
+   end
+end
+
 return pdx